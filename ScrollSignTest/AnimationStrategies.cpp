@@ -1,148 +1,154 @@
 // AnimationStrategies.cpp: Implementation of animation strategies for ScrollSignTest.
 // Each AnimationStrategy subclass implements a different text animation effect.
 // Only non-scroll animations are used if the text fits on the display; otherwise, ScrollAnimation is used.
+// Every frame is drawn complete for a given elapsed time; there is no erasing by overdrawing in black.
 #include "AnimationStrategies.h"
+#include "TextStrip.h"
 #include "graphics.h"
 #include "led-matrix.h"
-#include <unistd.h>
 #include <cmath>
 #include <cstring>
 #include <algorithm>
 #include <random>
 #include <string>
+#include <vector>
+
+void AnimationStrategy::start(const Font &font, const string &text, int y, const Color &color, int speed_ms, int width, int height) {
+    font_ = &font;
+    text_ = text;
+    y_ = y;
+    color_ = color;
+    speed_ms_ = std::max(1, speed_ms);
+    width_ = width;
+    height_ = height;
+    text_width_ = rgb_matrix::MeasureText(font, text.c_str());
+    onStart();
+}
 
 // ScrollAnimation: Scrolls the text horizontally across the canvas. Used for long messages.
-void ScrollAnimation::render(Canvas *canvas, Font &font, const string &text, int y, const Color &color, int speed_ms) {
-    char buf[1024];
-    strncpy(buf, text.c_str(), sizeof(buf));
-    buf[sizeof(buf)-1] = 0;
-    int draw_len = static_cast<int>(text.size()) * 9; // approximate width
-    int prev_x = canvas->width();
-    for (int r = 0; r < 2; ++r) {
-        for (int x = canvas->width(); x > -draw_len - 40; --x) {
-            // Erase previous text by overdrawing with black
-            if (x != prev_x) {
-                rgb_matrix::DrawText(canvas, font, prev_x, y + font.baseline(), Color(0,0,0), nullptr, buf);
-            }
-            rgb_matrix::DrawText(canvas, font, x, y + font.baseline(), color, nullptr, buf);
-            usleep(speed_ms * 1000);
-            prev_x = x;
-        }
-    }
+// Moves one pixel every speed_ms. The text is rasterized once per message and
+// each frame copies the visible window of that strip.
+void ScrollAnimation::onStart() {
+    // Rows take turns, so one cache for the whole sign is enough. It holds a
+    // feed's worth of titles so a message shown again is not rasterized again.
+    static TextStripCache cache(64);
+    strip_ = cache.get(*font_, text_);
+}
+
+int64_t ScrollAnimation::render(Canvas *canvas, int64_t elapsed_ms) {
+    int draw_len = strip_->width();
+    int pass_len = width_ + draw_len;   // from entering on the right to gone on the left
+    int64_t pos = elapsed_ms / speed_ms_;
+    if (pos >= 2 * pass_len) return -1;
+    int x = width_ - (int)(pos % pass_len);
+    strip_->draw(canvas, x, y_, color_);
+    return (pos + 1) * speed_ms_;
 }
 
 // BlinkAnimation: Blinks the text in place several times.
-void BlinkAnimation::render(Canvas *canvas, Font &font, const string &text, int y, const Color &color, int /*speed_ms*/) {
-    char buf[1024];
-    strncpy(buf, text.c_str(), sizeof(buf));
-    buf[sizeof(buf)-1] = 0;
-    int draw_len = static_cast<int>(text.size()) * 9;
-    int start_x = (int)round((canvas->width() - draw_len) / 2.0);
-    for (int i = 0; i < 6; ++i) {
-        rgb_matrix::DrawText(canvas, font, start_x, y + font.baseline(), color, nullptr, buf);
-        usleep(1000 * 3000);
-        rgb_matrix::DrawText(canvas, font, start_x, y + font.baseline(), Color(0,0,0), nullptr, buf);
-        usleep(500 * 2000);
-    }
+int64_t BlinkAnimation::render(Canvas *canvas, int64_t elapsed_ms) {
+    const int on_ms = 1000 * 3, off_ms = 500 * 2;
+    const int period = on_ms + off_ms;
+    int64_t blink = elapsed_ms / period;
+    if (blink >= 6) return -1;
+    int64_t blink_start = blink * period;
+    if (elapsed_ms - blink_start >= on_ms) return blink_start + period;  // the cleared row is the "off" frame
+    int draw_len = text_width_;
+    int start_x = (int)round((width_ - draw_len) / 2.0);
+    rgb_matrix::DrawText(canvas, *font_, start_x, baseline(), color_, nullptr, text_.c_str());
+    return blink_start + on_ms;
 }
 
 // FadeAnimation: Fades the text in and out at the center of the display.
-void FadeAnimation::render(Canvas *canvas, Font &font, const string &text, int y, const Color &color, int speed_ms) {
-    char buf[1024];
-    strncpy(buf, text.c_str(), sizeof(buf));
-    buf[sizeof(buf)-1] = 0;
-    int draw_len = static_cast<int>(text.size()) * 9;
-    int start_x = (int)round((canvas->width() - draw_len) / 2.0);
+int64_t FadeAnimation::render(Canvas *canvas, int64_t elapsed_ms) {
+    int draw_len = text_width_;
+    int start_x = (int)round((width_ - draw_len) / 2.0);
     int min_duration_ms = 10000; // 10 seconds
     int fade_steps = 22; // 11 in, 11 out
-    int cycle_time_ms = fade_steps * speed_ms;
+    int step_ms = speed_ms_ * 3;
+    int cycle_time_ms = fade_steps * speed_ms_;
     int cycles = std::max(1, min_duration_ms / std::max(1, cycle_time_ms));
-    for (int c = 0; c < cycles; ++c) {
-        for (int step = 0; step <= 10; ++step) {
-            Color fadeColor(
-                (uint8_t)(color.r * step / 10),
-                (uint8_t)(color.g * step / 10),
-                (uint8_t)(color.b * step / 10)
-            );
-            rgb_matrix::DrawText(canvas, font, start_x, y + font.baseline(), fadeColor, nullptr, buf);
-            usleep(speed_ms * 3000);
-        }
-        for (int step = 10; step >= 0; --step) {
-            Color fadeColor(
-                (uint8_t)(color.r * step / 10),
-                (uint8_t)(color.g * step / 10),
-                (uint8_t)(color.b * step / 10)
-            );
-            rgb_matrix::DrawText(canvas, font, start_x, y + font.baseline(), fadeColor, nullptr, buf);
-            usleep(speed_ms * 3000);
-        }
-    }
+    int64_t step = elapsed_ms / step_ms;
+    if (step >= cycles * fade_steps) return -1;
+    int phase = (int)(step % fade_steps);
+    int level = (phase <= 10) ? phase : fade_steps - 1 - phase;
+    Color fadeColor(
+        (uint8_t)(color_.r * level / 10),
+        (uint8_t)(color_.g * level / 10),
+        (uint8_t)(color_.b * level / 10)
+    );
+    rgb_matrix::DrawText(canvas, *font_, start_x, baseline(), fadeColor, nullptr, text_.c_str());
+    return (step + 1) * step_ms;
 }
 
 // WaveAnimation: Animates the text with a sine wave effect, making each character move up and down.
-void WaveAnimation::render(Canvas *canvas, Font &font, const string &text, int y, const Color &color, int speed_ms) {
-    int base_x = (int)round((canvas->width() - text.size() * 9) / 2.0);
+int64_t WaveAnimation::render(Canvas *canvas, int64_t elapsed_ms) {
+    int base_x = (int)round((width_ - text_width_) / 2.0);
     int min_duration_ms = 10000; // 10 seconds
-    int frames = std::max(32, min_duration_ms / std::max(1, speed_ms));
-    for (int frame = 0; frame < frames; ++frame) {
-        for (size_t i = 0; i < text.size(); ++i) {
-            int char_x = base_x + (int)(i * 9);
-            int wave_y = y + font.baseline() + (int)(3 * sin((frame + i) * 0.5));
-            rgb_matrix::DrawText(canvas, font, char_x, wave_y, color, nullptr, string(1, text[i]).c_str());
-        }
-        usleep(speed_ms * 3000);
-        // Erase by overdrawing with black
-        for (size_t i = 0; i < text.size(); ++i) {
-            int char_x = base_x + (int)(i * 9);
-            int wave_y = y + font.baseline() + (int)(3 * sin((frame + i) * 0.5));
-            rgb_matrix::DrawText(canvas, font, char_x, wave_y, Color(0,0,0), nullptr, string(1, text[i]).c_str());
-        }
+    int frames = std::max(32, min_duration_ms / std::max(1, speed_ms_));
+    int step_ms = speed_ms_ * 3;
+    int64_t frame = elapsed_ms / step_ms;
+    if (frame >= frames) return -1;
+    int char_x = base_x;
+    int i = 0;
+    for (size_t pos = 0; pos < text_.size(); ++i) {
+        // One character is the lead byte and its UTF-8 continuation bytes.
+        size_t len = 1;
+        while (pos + len < text_.size() && (text_[pos + len] & 0xC0) == 0x80) ++len;
+        string ch = text_.substr(pos, len);
+        int wave_y = baseline() + (int)(3 * sin((frame + i) * 0.5));
+        char_x += rgb_matrix::DrawText(canvas, *font_, char_x, wave_y, color_, nullptr, ch.c_str());
+        pos += len;
     }
+    return (frame + 1) * step_ms;
 }
 
 // BounceAnimation: Moves the text horizontally, bouncing off the display edges.
-void BounceAnimation::render(Canvas *canvas, Font &font, const string &text, int y, const Color &color, int speed_ms) {
-    char buf[1024];
-    strncpy(buf, text.c_str(), sizeof(buf));
-    buf[sizeof(buf)-1] = 0;
-    int draw_len = static_cast<int>(text.size()) * 9;
-    int min_x = 0, max_x = canvas->width() - draw_len;
-    int x = min_x, dx = 2;
-    int bounce_frames = 2 * (max_x - min_x);
+int64_t BounceAnimation::render(Canvas *canvas, int64_t elapsed_ms) {
+    int draw_len = text_width_;
+    int min_x = 0, max_x = width_ - draw_len;
+    int span = std::max(0, max_x - min_x);
+    int bounce_frames = 2 * span;
     int min_duration_ms = 10000; // 10 seconds
-    int frames = std::max(bounce_frames, min_duration_ms / std::max(1, speed_ms));
-    for (int frame = 0; frame < frames; ++frame) {
-        rgb_matrix::DrawText(canvas, font, x, y + font.baseline(), color, nullptr, buf);
-        usleep(speed_ms * 3000);
-        rgb_matrix::DrawText(canvas, font, x, y + font.baseline(), Color(0,0,0), nullptr, buf);
-        x += dx;
-        if (x <= min_x || x >= max_x) dx = -dx;
+    int frames = std::max(bounce_frames, min_duration_ms / std::max(1, speed_ms_));
+    int step_ms = speed_ms_ * 3;
+    int64_t frame = elapsed_ms / step_ms;
+    if (frame >= frames) return -1;
+    // Two pixels per frame, back and forth between the edges.
+    int x = min_x;
+    if (span > 0) {
+        int pos = (int)((2 * frame) % (2 * span));
+        x = (pos <= span) ? min_x + pos : max_x - (pos - span);
     }
+    rgb_matrix::DrawText(canvas, *font_, x, baseline(), color_, nullptr, text_.c_str());
+    return (frame + 1) * step_ms;
 }
 
 // TypewriterAnimation: Reveals the text one character at a time, simulating typing.
-void TypewriterAnimation::render(Canvas *canvas, Font &font, const string &text, int y, const Color &color, int speed_ms) {
-    int start_x = (int)round((canvas->width() - text.size() * 9) / 2.0);
-    string shown;
-    for (size_t i = 0; i < text.size(); ++i) {
-        shown += text[i];
-        rgb_matrix::DrawText(canvas, font, start_x, y + font.baseline(), color, nullptr, shown.c_str());
-        usleep(speed_ms * 3000);
-        rgb_matrix::DrawText(canvas, font, start_x, y + font.baseline(), Color(0,0,0), nullptr, shown.c_str());
+int64_t TypewriterAnimation::render(Canvas *canvas, int64_t elapsed_ms) {
+    int start_x = (int)round((width_ - text_width_) / 2.0);
+    // Type whole UTF-8 characters: the end of each is before the next lead byte.
+    std::vector<size_t> ends;
+    for (size_t pos = 1; pos <= text_.size(); ++pos) {
+        if (pos == text_.size() || (text_[pos] & 0xC0) != 0x80) ends.push_back(pos);
     }
-    // Show full text at end
-    rgb_matrix::DrawText(canvas, font, start_x, y + font.baseline(), color, nullptr, text.c_str());
-    usleep(1000 * 5000);
-    rgb_matrix::DrawText(canvas, font, start_x, y + font.baseline(), Color(0,0,0), nullptr, text.c_str());
+    int chars = static_cast<int>(ends.size());
+    int step_ms = speed_ms_ * 3;
+    // The full text stays up a while longer once typed.
+    int64_t typed_ms = (int64_t)std::max(0, chars - 1) * step_ms;
+    int64_t end_ms = typed_ms + step_ms + 1000 * 5;
+    if (elapsed_ms >= end_ms) return -1;
+    int64_t shown_chars = std::min<int64_t>(chars, elapsed_ms / step_ms + 1);
+    string shown = text_.substr(0, shown_chars > 0 ? ends[shown_chars - 1] : 0);
+    rgb_matrix::DrawText(canvas, *font_, start_x, baseline(), color_, nullptr, shown.c_str());
+    return (shown_chars < chars) ? shown_chars * step_ms : end_ms;
 }
 
-// DiagonalSlideAnimation: Slides the text into place from a random bottom or top corner depending on row.
-void DiagonalSlideAnimation::render(Canvas *canvas, Font &font, const string &text, int y, const Color &color, int speed_ms) {
-    int draw_len = static_cast<int>(text.size()) * 9;
-    int final_x = (int)round((canvas->width() - draw_len) / 2.0);
-    int final_y = y + font.baseline();
-    // Determine if this is the top or bottom row
-    bool fromTop = (y == 0);
+// DiagonalSlideAnimation: Slides the text into place from a random bottom or top corner depending on lane.
+void DiagonalSlideAnimation::onStart() {
+    int draw_len = text_width_;
+    // The lane at the top of the display slides in from above, the others from below.
+    bool fromTop = (y_ == 0);
     std::random_device rd; std::mt19937 gen(rd());
     int direction;
     if (fromTop) {
@@ -152,32 +158,39 @@ void DiagonalSlideAnimation::render(Canvas *canvas, Font &font, const string &te
         // Bottom row: randomly choose bottom-left or bottom-right
         direction = std::uniform_int_distribution<int>(2,3)(gen);
     }
-    int start_x, start_y;
     switch (direction) {
         case 0: // top-left
-            start_x = -draw_len; start_y = -font.height(); break;
+            start_x_ = -draw_len; start_y_ = y_ - font_->height(); break;
         case 1: // top-right
-            start_x = canvas->width(); start_y = -font.height(); break;
+            start_x_ = width_; start_y_ = y_ - font_->height(); break;
         case 2: // bottom-left
-            start_x = -draw_len; start_y = canvas->height() + font.height(); break;
+            start_x_ = -draw_len; start_y_ = y_ + height_ + font_->height(); break;
         case 3: // bottom-right
-            start_x = canvas->width(); start_y = canvas->height() + font.height(); break;
+            start_x_ = width_; start_y_ = y_ + height_ + font_->height(); break;
         default:
-            start_x = -draw_len; start_y = -font.height(); break;
+            start_x_ = -draw_len; start_y_ = y_ - font_->height(); break;
     }
+}
+
+int64_t DiagonalSlideAnimation::render(Canvas *canvas, int64_t elapsed_ms) {
+    int draw_len = text_width_;
+    int final_x = (int)round((width_ - draw_len) / 2.0);
+    int final_y = baseline();
     int steps = 20;
-    for (int step = 0; step <= steps; ++step) {
-        float t = step / (float)steps;
-        int curr_x = (int)(start_x + t * (final_x - start_x));
-        int curr_y = (int)(start_y + t * (final_y - start_y));
-        rgb_matrix::DrawText(canvas, font, curr_x, curr_y, color, nullptr, text.c_str());
-        usleep(speed_ms * 1000);
-        rgb_matrix::DrawText(canvas, font, curr_x, curr_y, Color(0,0,0), nullptr, text.c_str());
+    // Steps 0..steps slide in, then the final position is held for a second.
+    int64_t slide_ms = (int64_t)(steps + 1) * speed_ms_;
+    int64_t end_ms = slide_ms + 1000 * 1;
+    if (elapsed_ms >= end_ms) return -1;
+    if (elapsed_ms >= slide_ms) {
+        rgb_matrix::DrawText(canvas, *font_, final_x, final_y, color_, nullptr, text_.c_str());
+        return end_ms;
     }
-    // Draw final position
-    rgb_matrix::DrawText(canvas, font, final_x, final_y, color, nullptr, text.c_str());
-    usleep(1000 * 1000);
-    rgb_matrix::DrawText(canvas, font, final_x, final_y, Color(0,0,0), nullptr, text.c_str());
+    int64_t step = elapsed_ms / speed_ms_;
+    float t = step / (float)steps;
+    int curr_x = (int)(start_x_ + t * (final_x - start_x_));
+    int curr_y = (int)(start_y_ + t * (final_y - start_y_));
+    rgb_matrix::DrawText(canvas, *font_, curr_x, curr_y, color_, nullptr, text_.c_str());
+    return (step + 1) * speed_ms_;
 }
 
 // chooseStrategy: Selects an animation strategy based on whether the text fits.
@@ -6,63 +6,101 @@
 #include <memory>
 #include <random>
 
+class TextStrip;
+
 using namespace rgb_matrix;
 using std::string;
 
 // Abstract base class for animation strategies.
+// An animation is a function of the time elapsed since it started: the frame
+// scheduler asks for the picture at any point in time, so a late frame skips
+// ahead instead of slowing the animation down, and several rows can animate
+// independently on the same display.
 class AnimationStrategy {
 public:
+    AnimationStrategy() : font_(nullptr), y_(0), color_(0,0,0), speed_ms_(0), width_(0), height_(0), text_width_(0) {}
     virtual ~AnimationStrategy() {}
-    // Renders the text on the canvas using the given font, color, and speed.
-    virtual void render(Canvas *canvas, Font &font, const string &text, int y, const Color &color, int speed_ms) = 0;
+
+    // Sets up the animation of the text in the lane of "height" rows starting
+    // at y on a display "width" wide, using the given font, color, and speed.
+    void start(const Font &font, const string &text, int y, const Color &color, int speed_ms, int width, int height);
+
+    // Draws the frame "elapsed_ms" after the start into canvas, which holds
+    // the already cleared lane. Returns the elapsed time at which the picture
+    // changes next, or -1 once the animation has finished (nothing is drawn
+    // then).
+    virtual int64_t render(Canvas *canvas, int64_t elapsed_ms) = 0;
+
+protected:
+    // Called by start() once the parameters are set.
+    virtual void onStart() {}
+
+    int baseline() const { return y_ + font_->baseline(); }
+
+    const Font *font_;
+    string text_;
+    int y_;
+    Color color_;
+    int speed_ms_;
+    int width_;
+    int height_;       // Of the lane.
+    int text_width_;   // Pixel width of text_ in font_.
 };
 
 // Scrolls the text horizontally across the canvas.
 class ScrollAnimation : public AnimationStrategy {
 public:
-    void render(Canvas *canvas, Font &font, const string &text, int y, const Color &color, int speed_ms) override;
+    int64_t render(Canvas *canvas, int64_t elapsed_ms) override;
+protected:
+    void onStart() override;
+private:
+    std::shared_ptr<const TextStrip> strip_;
 };
 
 // Blinks the text in place several times.
 class BlinkAnimation : public AnimationStrategy {
 public:
-    void render(Canvas *canvas, Font &font, const string &text, int y, const Color &color, int speed_ms) override;
+    int64_t render(Canvas *canvas, int64_t elapsed_ms) override;
 };
 
 // Fade In/Out Animation
 class FadeAnimation : public AnimationStrategy {
 public:
-    void render(Canvas *canvas, Font &font, const string &text, int y, const Color &color, int speed_ms) override;
+    int64_t render(Canvas *canvas, int64_t elapsed_ms) override;
 };
 
 // Wave Animation
 class WaveAnimation : public AnimationStrategy {
 public:
-    void render(Canvas *canvas, Font &font, const string &text, int y, const Color &color, int speed_ms) override;
+    int64_t render(Canvas *canvas, int64_t elapsed_ms) override;
 };
 
 // Bounce Animation
 class BounceAnimation : public AnimationStrategy {
 public:
-    void render(Canvas *canvas, Font &font, const string &text, int y, const Color &color, int speed_ms) override;
+    int64_t render(Canvas *canvas, int64_t elapsed_ms) override;
 };
 
 // Typewriter Animation
 class TypewriterAnimation : public AnimationStrategy {
 public:
-    void render(Canvas *canvas, Font &font, const string &text, int y, const Color &color, int speed_ms) override;
+    int64_t render(Canvas *canvas, int64_t elapsed_ms) override;
 };
 
 // Flip Animation
 class FlipAnimation : public AnimationStrategy {
 public:
-    void render(Canvas *canvas, Font &font, const string &text, int y, const Color &color, int speed_ms) override;
+    int64_t render(Canvas *canvas, int64_t elapsed_ms) override;
 };
 
 // Diagonal Slide Animation
 class DiagonalSlideAnimation : public AnimationStrategy {
 public:
-    void render(Canvas *canvas, Font &font, const string &text, int y, const Color &color, int speed_ms) override;
+    int64_t render(Canvas *canvas, int64_t elapsed_ms) override;
+protected:
+    void onStart() override;
+private:
+    int start_x_, start_y_;
 };
 
 // Chooses an animation strategy based on whether the text fits and randomness.
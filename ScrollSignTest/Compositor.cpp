@@ -0,0 +1,95 @@
+// Compositor.cpp: Implementation of off-screen frame composition for ScrollSignTest.
+#include "Compositor.h"
+#include <algorithm>
+#include <poll.h>
+#include <unistd.h>
+
+void BandCanvas::setTarget(Canvas *target, int top, int height)
+{
+    target_ = target;
+    top_ = top;
+    bottom_ = top + height;
+}
+
+void BandCanvas::SetPixel(int x, int y, uint8_t red, uint8_t green, uint8_t blue)
+{
+    if (y < top_ || y >= bottom_) return;
+    target_->SetPixel(x, y, red, green, blue);
+}
+
+void BandCanvas::SetPixels(int x, int y, int width, int height, const uint8_t *rgb, int stride)
+{
+    int first = std::max(0, top_ - y);
+    int last = std::min(height, bottom_ - y);
+    if (first >= last) return;
+    target_->SetPixels(x, y + first, width, last - first, rgb + first * stride, stride);
+}
+
+void BandCanvas::FillRect(int x, int y, int width, int height, uint8_t red, uint8_t green, uint8_t blue)
+{
+    int first = std::max(y, top_);
+    int last = std::min(y + height, bottom_);
+    if (first >= last) return;
+    target_->FillRect(x, first, width, last - first, red, green, blue);
+}
+
+void BandCanvas::SetBitmap(int x, int y, int width, int height, const uint32_t *rows,
+                           uint8_t red, uint8_t green, uint8_t blue)
+{
+    // Clip to the band, then let the target draw the rows natively.
+    int first = std::max(0, top_ - y);
+    int last = std::min(height, bottom_ - y);
+    if (first >= last) return;
+    target_->SetBitmap(x, y + first, width, last - first, rows + first, red, green, blue);
+}
+
+void BandCanvas::Clear()
+{
+    Fill(0, 0, 0);
+}
+
+void BandCanvas::Fill(uint8_t red, uint8_t green, uint8_t blue)
+{
+    target_->FillRect(0, top_, target_->width(), bottom_ - top_, red, green, blue);
+}
+
+Compositor::Compositor(RGBMatrix *matrix)
+    : matrix_(matrix), back_(matrix->CreateFrameCanvas()),
+      doneFd_(matrix->frame_done_fd()), submitted_(false), ticket_(0)
+{
+}
+
+Canvas *Compositor::beginLane(int y, int height)
+{
+    band_.setTarget(back_, y, height);
+    band_.Clear();
+    return &band_;
+}
+
+void Compositor::present()
+{
+    // A frame submitted while the previous one still waits would replace it,
+    // and the rows would jump a step. Only happens if we draw faster than
+    // the refresh rate.
+    // The fd counts every switch, also those since we last read it, so
+    // waking up doesn't mean our frame is shown yet.
+    while (submitted_ && matrix_->FramePending(ticket_)) {
+        struct pollfd done = { doneFd_, POLLIN, 0 };
+        uint64_t count;
+        if (poll(&done, 1, -1) > 0) (void)read(doneFd_, &count, sizeof(count));
+    }
+
+    FrameCanvas *shown = back_;
+    ticket_ = matrix_->SubmitFrame(shown);
+    submitted_ = true;
+
+    // Draw the next frame while this one is switched to. The first time round
+    // the previously shown buffer is still on display, so we need a third one.
+    back_ = matrix_->TakeFreeFrame();
+    if (back_ == nullptr) back_ = matrix_->CreateFrameCanvas();
+
+    // The buffer we get back is behind. Bring it up to date so the next frame
+    // only has to redraw the lanes that changed. Only the rows written to since
+    // it was last copied are copied.
+    back_->CopyFrom(*shown);
+}
@@ -0,0 +1,63 @@
+// Compositor.h: Off-screen frame composition for ScrollSignTest.
+// Animations draw complete frames into an off-screen FrameCanvas which is then
+// submitted in one go, so the refresh thread never scans out a half-drawn
+// frame. Submitting doesn't wait for the vsync: the next frame is drawn while
+// the refresh thread switches to this one.
+#pragma once
+#include "led-matrix.h"
+
+using namespace rgb_matrix;
+
+// Canvas that restricts drawing to a horizontal band of another canvas.
+// Coordinates stay absolute; pixels outside of the band are dropped, so one
+// lane's animation can't draw over the other lanes.
+class BandCanvas : public Canvas {
+public:
+    BandCanvas() : target_(nullptr), top_(0), bottom_(0) {}
+
+    // Directs drawing to rows [top, top + height) of "target".
+    void setTarget(Canvas *target, int top, int height);
+
+    int width() const override { return target_->width(); }
+    int height() const override { return target_->height(); }
+    void SetPixel(int x, int y, uint8_t red, uint8_t green, uint8_t blue) override;
+    void SetPixels(int x, int y, int width, int height, const uint8_t *rgb, int stride) override;
+    void FillRect(int x, int y, int width, int height, uint8_t red, uint8_t green, uint8_t blue) override;
+    void SetBitmap(int x, int y, int width, int height, const uint32_t *rows,
+                   uint8_t red, uint8_t green, uint8_t blue) override;
+    // Clear() and Fill() only affect the band.
+    void Clear() override;
+    void Fill(uint8_t red, uint8_t green, uint8_t blue) override;
+
+private:
+    Canvas *target_;
+    int top_;
+    int bottom_;
+};
+
+// Owns the off-screen buffers and publishes complete frames on vsync.
+// Each lane of the sign is a band of pixel rows. A frame redraws the lanes
+// that changed and keeps the others as they were last published.
+class Compositor {
+public:
+    explicit Compositor(RGBMatrix *matrix);
+
+    int width() const { return matrix_->width(); }
+    int height() const { return matrix_->height(); }
+
+    // Clears the "height" rows starting at "y" in the frame being prepared and
+    // returns a canvas clipped to them. The canvas is valid until the next call.
+    Canvas *beginLane(int y, int height);
+
+    // Publishes the prepared frame on the next vsync. Only waits if the frame
+    // presented before hasn't been shown yet, so no frame is skipped.
+    void present();
+
+private:
+    RGBMatrix *const matrix_;
+    FrameCanvas *back_;
+    BandCanvas band_;
+    const int doneFd_;    // Readable when the refresh switched frames.
+    bool submitted_;      // Whether ticket_ is valid.
+    uint32_t ticket_;     // Of the frame presented last.
+};
@@ -0,0 +1,80 @@
+// FeedService.cpp: Implementation of background message fetching for ScrollSignTest.
+#include "FeedService.h"
+#include <algorithm>
+
+FeedService::FeedService(int64_t refreshMs) : refresh_(refreshMs), stop_(false)
+{
+}
+
+FeedService::~FeedService()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+    }
+    wakeup_.notify_all();
+    if (thread_.joinable()) thread_.join();
+}
+
+int FeedService::addSource(RequestsFunction requests, BuildFunction build)
+{
+    Source source;
+    source.requests = std::move(requests);
+    source.build = std::move(build);
+    sources_.push_back(std::move(source));
+    return (int)sources_.size() - 1;
+}
+
+void FeedService::start()
+{
+    auto now = std::chrono::steady_clock::now();
+    for (auto &source : sources_) source.due = now;
+    FeedFetcher::globalInit();
+    thread_ = std::thread(&FeedService::run, this);
+}
+
+std::shared_ptr<const MessageSnapshot> FeedService::latest(int id) const
+{
+    return std::atomic_load(&sources_[id].snapshot);
+}
+
+// Fetches every source that is due in one batch of downloads, then sleeps
+// until the next source is due or we are stopped. The fetcher lives on this
+// thread, keeping its connections open between batches.
+void FeedService::run()
+{
+    FeedFetcher fetcher;
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!stop_ && !sources_.empty()) {
+        auto started = std::chrono::steady_clock::now();
+        std::vector<Source *> due;
+        for (auto &source : sources_) {
+            if (started < source.due) continue;
+            source.due = started + refresh_;
+            due.push_back(&source);
+        }
+
+        if (!due.empty()) {
+            lock.unlock();
+            std::vector<FeedRequest> requests;
+            for (Source *source : due) {
+                std::vector<FeedRequest> r = source->requests();
+                requests.insert(requests.end(), r.begin(), r.end());
+            }
+            std::map<std::string, Download> downloads = fetcher.fetch(requests);
+            for (Source *source : due) {
+                // Only this thread replaces snapshots, so "previous" stays current.
+                auto previous = std::atomic_load(&source->snapshot);
+                std::shared_ptr<MessageSnapshot> snapshot(new MessageSnapshot);
+                snapshot->messages = source->build(downloads);
+                snapshot->generation = previous ? previous->generation + 1 : 1;
+                std::atomic_store(&source->snapshot, std::shared_ptr<const MessageSnapshot>(snapshot));
+            }
+            lock.lock();
+        }
+
+        auto next = sources_.front().due;
+        for (const auto &source : sources_) next = std::min(next, source.due);
+        wakeup_.wait_until(lock, next, [this] { return stop_; });
+    }
+}
@@ -0,0 +1,70 @@
+// FeedService.h: Background message fetching for ScrollSignTest.
+// A service thread refreshes the messages of every source on its own schedule
+// and publishes them as immutable snapshots. The display threads only ever
+// pick up the newest snapshot, so slow or dead feeds never stall the sign.
+// The feeds of all sources due together are downloaded at the same time.
+#pragma once
+#include "MessageSources.h"
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// The messages of one source as fetched at one point in time. Never changed
+// once published, so it can be shared between threads without locking.
+struct MessageSnapshot {
+    std::vector<std::string> messages;
+    unsigned generation;    // Number of the fetch, counting from 1.
+};
+
+class FeedService {
+public:
+    // A source lists the URLs it needs, then makes its messages from their
+    // downloads.
+    typedef std::function<std::vector<FeedRequest>()> RequestsFunction;
+    typedef std::function<std::vector<std::string>(const std::map<std::string, Download> &)> BuildFunction;
+
+    // Each source is fetched again "refreshMs" milliseconds after its last
+    // fetch started.
+    explicit FeedService(int64_t refreshMs);
+
+    // Stops the service thread, after the fetch in progress if any.
+    ~FeedService();
+
+    // Adds a source whose messages are fetched by downloading what "requests"
+    // returns and passing that to "build", both called on the service thread.
+    // Returns the id to get its snapshots with. Sources can only be added
+    // before start().
+    int addSource(RequestsFunction requests, BuildFunction build);
+
+    // Starts the service thread, which fetches all sources right away.
+    void start();
+
+    // The newest snapshot of source "id", or null while its first fetch is
+    // still running. Can be called from any thread.
+    std::shared_ptr<const MessageSnapshot> latest(int id) const;
+
+private:
+    struct Source {
+        RequestsFunction requests;
+        BuildFunction build;
+        std::shared_ptr<const MessageSnapshot> snapshot;   // Atomically replaced.
+        std::chrono::steady_clock::time_point due;
+    };
+
+    void run();
+
+    const std::chrono::milliseconds refresh_;
+    std::vector<Source> sources_;
+
+    std::thread thread_;
+    std::mutex mutex_;
+    std::condition_variable wakeup_;
+    bool stop_;     // Guarded by mutex_.
+};
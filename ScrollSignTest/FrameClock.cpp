@@ -0,0 +1,40 @@
+// FrameClock.cpp: Implementation of absolute-deadline frame pacing for ScrollSignTest.
+#include "FrameClock.h"
+#include <cerrno>
+
+FrameClock::FrameClock() : missed_(0), last_lateness_ms_(0)
+{
+    clock_gettime(CLOCK_MONOTONIC, &epoch_);
+}
+
+int64_t FrameClock::nowMs() const
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    int64_t ns = (int64_t)(now.tv_sec - epoch_.tv_sec) * 1000000000
+        + (now.tv_nsec - epoch_.tv_nsec);
+    return ns / 1000000;
+}
+
+bool FrameClock::sleepUntil(int64_t deadline_ms)
+{
+    int64_t lateness = nowMs() - deadline_ms;
+    if (lateness > 0) {
+        ++missed_;
+        last_lateness_ms_ = lateness;
+        return false;
+    }
+
+    // Convert back to an absolute CLOCK_MONOTONIC time.
+    struct timespec wake = epoch_;
+    wake.tv_sec += deadline_ms / 1000;
+    wake.tv_nsec += (deadline_ms % 1000) * 1000000;
+    if (wake.tv_nsec >= 1000000000) {
+        wake.tv_nsec -= 1000000000;
+        ++wake.tv_sec;
+    }
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, nullptr) == EINTR) {
+        // Interrupted by a signal; the deadline is absolute, so just go on sleeping.
+    }
+    return true;
+}
@@ -0,0 +1,30 @@
+// FrameClock.h: Absolute-deadline frame pacing for ScrollSignTest.
+// Sleeps until absolute points in time on CLOCK_MONOTONIC, so drawing time and
+// scheduler jitter never add up into drift, and keeps track of frames that
+// could not be shown on time.
+#pragma once
+#include <cstdint>
+#include <ctime>
+
+class FrameClock {
+public:
+    FrameClock();
+
+    // Milliseconds since the clock was created.
+    int64_t nowMs() const;
+
+    // Sleeps until "deadline_ms" (as returned by nowMs()). If the deadline has
+    // already passed, returns false immediately and counts it as missed.
+    bool sleepUntil(int64_t deadline_ms);
+
+    // Number of deadlines that had passed before we got to sleep for them.
+    unsigned missedDeadlines() const { return missed_; }
+
+    // How late the latest missed deadline was, in milliseconds.
+    int64_t lastLatenessMs() const { return last_lateness_ms_; }
+
+private:
+    struct timespec epoch_;
+    unsigned missed_;
+    int64_t last_lateness_ms_;
+};
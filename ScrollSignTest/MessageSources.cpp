@@ -3,22 +3,47 @@
 
 #include "MessageSources.h"
 #include "pugixml.hpp"
-#include <regex>
 #include <curl/curl.h>
+#include <strings.h>
 #include <unistd.h>
 #include <string>
 #include <vector>
 #include <iostream>
+#include <memory>
 
 extern int isDebug;
 
-// Callback for libcurl to write received data into a string buffer.
+// Callback for libcurl to pass received data on to the RSS extractor. Once
+// that has all it wants, fails the write to end the transfer.
 static size_t WriteCurlCallback(void *contents, size_t size, size_t nmemb, void *userp)
 {
-    ((std::string *)userp)->append((char *)contents, size * nmemb);
+    RssExtractor *extractor = (RssExtractor *)userp;
+    if (!extractor->feed((char *)contents, size * nmemb)) return 0;
     return size * nmemb;
 }
 
+// Callback for libcurl to pick the validators out of the response headers.
+static size_t HeaderCurlCallback(char *buffer, size_t size, size_t nitems, void *userp)
+{
+    Download *d = (Download *)userp;
+    std::string line(buffer, size * nitems);
+    while (!line.empty() && (line.back() == '\r' || line.back() == '\n')) line.pop_back();
+    if (line.compare(0, 5, "HTTP/") == 0) {
+        // Status line of another response, e.g. after a 100 Continue.
+        d->etag.clear();
+        d->lastModified.clear();
+    }
+    size_t colon = line.find(':');
+    if (colon != std::string::npos) {
+        std::string name = line.substr(0, colon);
+        std::string value = line.substr(colon + 1);
+        value.erase(0, value.find_first_not_of(' '));
+        if (strcasecmp(name.c_str(), "ETag") == 0) d->etag = value;
+        else if (strcasecmp(name.c_str(), "Last-Modified") == 0) d->lastModified = value;
+    }
+    return size * nitems;
+}
+
 // Trims leading and trailing spaces from a string.
 static std::string trim(const std::string &str)
 {
@@ -45,6 +70,17 @@ static std::string resolveConfigPath(const std::string &fileName)
     return fileName; // last resort
 }
 
+// Resolve where to write a file of the Configs folder: where it already is, or
+// else next to Settings.xml.
+static std::string resolveWritableConfigPath(const std::string &fileName)
+{
+    std::string path = resolveConfigPath(fileName);
+    if (path != fileName) return path;
+    std::string settings = resolveConfigPath("Settings.xml");
+    size_t slash = settings.rfind('/');
+    return slash == std::string::npos ? fileName : settings.substr(0, slash + 1) + fileName;
+}
+
 // Loads items from an XML file, extracting child values under a given root.
 static std::vector<std::string> loadXmlItems(const std::string &path, const char *rootName, const char *childName)
 {
@@ -60,67 +96,233 @@ static std::vector<std::string> loadXmlItems(const std::string &path, const char
     return results;
 }
 
-// Gets feed URLs for the specified position (top/bottom) from XML.
-static std::vector<std::string> getFeedUrls(const std::string &position)
+// Gets feed URLs from the given feeds XML file.
+static std::vector<std::string> getFeedUrls(const std::string &feedsFile)
+{
+    if (feedsFile.empty()) return {};
+    return loadXmlItems(resolveConfigPath(feedsFile), "feeds", "url");
+}
+
+// Gets static message lines from the given lines XML file.
+static std::vector<std::string> getStaticLines(const std::string &linesFile)
+{
+    if (linesFile.empty()) return {};
+    return loadXmlItems(resolveConfigPath(linesFile), "lines", "text");
+}
+
+// Whether an item limit of "a" reads more items than one of "b"; 0 is none.
+static bool readsMore(size_t a, size_t b)
+{
+    return b != 0 && (a == 0 || a > b);
+}
+
+void FeedFetcher::globalInit()
+{
+    curl_global_init(CURL_GLOBAL_DEFAULT);
+}
+
+FeedFetcher::FeedFetcher()
+{
+    multi_ = curl_multi_init();
+    share_ = curl_share_init();
+    curl_share_setopt(share_, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(share_, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+    curl_share_setopt(share_, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+}
+
+FeedFetcher::~FeedFetcher()
+{
+    curl_multi_cleanup(multi_);
+    curl_share_cleanup(share_);
+}
+
+// Downloads the URLs as transfers of the multi handle, all running at once.
+// Connections stay open in the share handle's cache for the next batch.
+std::map<std::string, Download> FeedFetcher::fetch(const std::vector<FeedRequest> &requests)
+{
+    struct Transfer {
+        Download *download;
+        curl_slist *headers;
+        std::shared_ptr<RssExtractor> extractor;
+    };
+    // Of several requests of a URL, the one reading the most items serves all.
+    std::map<std::string, FeedRequest> byUrl;
+    for (auto &req : requests) {
+        auto found = byUrl.find(req.url);
+        if (found == byUrl.end()) byUrl[req.url] = req;
+        else if (readsMore(req.maxItems, found->second.maxItems)) found->second = req;
+    }
+    std::map<std::string, Download> downloads;
+    std::map<CURL *, Transfer> transfers;
+    for (auto &entry : byUrl) {
+        const FeedRequest &req = entry.second;
+        Download &d = downloads[req.url];
+        d.maxItems = req.maxItems;
+        CURL *curl = curl_easy_init();
+        if (!curl) { d.error = "Curl init failed"; continue; }
+        curl_slist *headers = nullptr;
+        if (!req.etag.empty()) headers = curl_slist_append(headers, ("If-None-Match: " + req.etag).c_str());
+        if (!req.lastModified.empty()) headers = curl_slist_append(headers, ("If-Modified-Since: " + req.lastModified).c_str());
+        curl_easy_setopt(curl, CURLOPT_URL, req.url.c_str());
+        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteCurlCallback);
+        std::shared_ptr<RssExtractor> extractor(new RssExtractor(req.maxItems));
+        curl_easy_setopt(curl, CURLOPT_WRITEDATA, extractor.get());
+        curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, HeaderCurlCallback);
+        curl_easy_setopt(curl, CURLOPT_HEADERDATA, &d);
+        curl_easy_setopt(curl, CURLOPT_SHARE, share_);
+        curl_easy_setopt(curl, CURLOPT_USERAGENT, "ScrollSignTest/1.0");
+        curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 5L);
+        curl_easy_setopt(curl, CURLOPT_TIMEOUT, 10L);
+        curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+        curl_multi_add_handle(multi_, curl);
+        transfers[curl] = Transfer{&d, headers, extractor};
+    }
+
+    int running = transfers.empty() ? 0 : 1;
+    while (running) {
+        CURLMcode mc = curl_multi_perform(multi_, &running);
+        if (mc == CURLM_OK && running) mc = curl_multi_wait(multi_, nullptr, 0, 1000, nullptr);
+        if (mc != CURLM_OK) {
+            if (isDebug) std::cerr << "curl multi failed: " << curl_multi_strerror(mc) << std::endl;
+            for (auto &t : transfers) t.second.download->error = curl_multi_strerror(mc);
+            break;
+        }
+        int queued;
+        while (CURLMsg *msg = curl_multi_info_read(multi_, &queued)) {
+            if (msg->msg != CURLMSG_DONE) continue;
+            CURL *curl = msg->easy_handle;
+            Transfer &t = transfers[curl];
+            Download &d = *t.download;
+            d.items.swap(t.extractor->items());
+            d.bytes = t.extractor->bytes();
+            d.complete = t.extractor->done();
+            // A write error is our own doing if the extractor had enough.
+            if (msg->data.result != CURLE_OK && !(msg->data.result == CURLE_WRITE_ERROR && d.complete)) {
+                d.error = curl_easy_strerror(msg->data.result);
+            }
+            curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &d.status);
+            curl_multi_remove_handle(multi_, curl);
+            curl_easy_cleanup(curl);
+            curl_slist_free_all(t.headers);
+            transfers.erase(curl);
+        }
+    }
+
+    // Only left over if the multi handle failed.
+    for (auto &t : transfers) {
+        curl_multi_remove_handle(multi_, t.first);
+        curl_easy_cleanup(t.first);
+        curl_slist_free_all(t.second.headers);
+    }
+    return downloads;
+}
+
+MessageAggregator::MessageAggregator(const std::string &cacheFile)
+    : cacheFile_(cacheFile.empty() ? cacheFile : resolveWritableConfigPath(cacheFile))
+{
+    loadCache();
+}
+
+// Reads the cached feeds, as written by saveCache().
+void MessageAggregator::loadCache()
 {
-    if (position == "top") return loadXmlItems(resolveConfigPath("TopFeeds.xml"), "feeds", "url");
-    if (position == "bottom") return loadXmlItems(resolveConfigPath("BottomFeeds.xml"), "feeds", "url");
-    return {};    
+    if (cacheFile_.empty()) return;
+    pugi::xml_document doc;
+    if (!doc.load_file(cacheFile_.c_str())) return;
+    pugi::xml_node root = doc.child("feedcache");
+    for (pugi::xml_node n = root.child("feed"); n; n = n.next_sibling("feed")) {
+        CachedFeed &feed = cache_[n.attribute("url").as_string()];
+        feed.etag = n.attribute("etag").as_string();
+        feed.lastModified = n.attribute("lastmodified").as_string();
+        feed.maxItems = n.attribute("items").as_uint(0);
+        for (pugi::xml_node t = n.child("title"); t; t = t.next_sibling("title")) {
+            feed.titles.push_back(t.child_value());
+        }
+    }
 }
 
-// Gets static message lines for the specified position (top/bottom) from XML.
-static std::vector<std::string> getStaticLines(const std::string &position)
+void MessageAggregator::saveCache() const
 {
-    if (position == "top") return loadXmlItems(resolveConfigPath("TopLines.xml"), "lines", "text");
-    if (position == "bottom") return loadXmlItems(resolveConfigPath("BottomLines.xml"), "lines", "text");
-    return {};    
+    if (cacheFile_.empty()) return;
+    pugi::xml_document doc;
+    pugi::xml_node root = doc.append_child("feedcache");
+    for (auto &entry : cache_) {
+        pugi::xml_node n = root.append_child("feed");
+        n.append_attribute("url").set_value(entry.first.c_str());
+        n.append_attribute("etag").set_value(entry.second.etag.c_str());
+        n.append_attribute("lastmodified").set_value(entry.second.lastModified.c_str());
+        n.append_attribute("items").set_value((unsigned int)entry.second.maxItems);
+        for (auto &title : entry.second.titles) n.append_child("title").text().set(title.c_str());
+    }
+    if (!doc.save_file(cacheFile_.c_str()) && isDebug) std::cerr << "Couldn't write " << cacheFile_ << std::endl;
 }
 
-// Fetches the content of a URL using libcurl. Returns error string if any.
-static std::string fetchUrl(const std::string &url, std::string &err)
+std::vector<FeedRequest> MessageAggregator::feedRequests(const std::string &feedsFile, size_t maxItems)
 {
-    err.clear();
-    CURL *curl = curl_easy_init();
-    std::string buf;
-    if (!curl) { err = "Curl init failed"; return buf; }
-    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteCurlCallback);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &buf);
-    curl_easy_setopt(curl, CURLOPT_USERAGENT, "ScrollSignTest/1.0");
-    curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 5L);
-    curl_easy_setopt(curl, CURLOPT_TIMEOUT, 10L);
-    CURLcode res = curl_easy_perform(curl);
-    if (res != CURLE_OK) {
-        err = curl_easy_strerror(res);
+    std::vector<FeedRequest> requests;
+    for (auto &u : getFeedUrls(feedsFile)) {
+        FeedRequest req;
+        req.url = u;
+        req.maxItems = maxItems;
+        // Titles read with another limit are no use for this one.
+        auto cached = cache_.find(u);
+        if (cached != cache_.end() && cached->second.maxItems == maxItems) {
+            req.etag = cached->second.etag;
+            req.lastModified = cached->second.lastModified;
+        }
+        requests.push_back(req);
     }
-    curl_easy_cleanup(curl);
-    return buf;
+    return requests;
 }
 
 // Aggregates messages from RSS feeds and static lines, applying regex filtering.
-std::vector<std::string> MessageAggregator::fetchAll(const std::string &position, const std::string &regexStr)
+std::vector<std::string> MessageAggregator::aggregate(const std::string &feedsFile, const std::string &linesFile,
+                                                      const TitleFilter &filter,
+                                                      const std::map<std::string, Download> &downloads,
+                                                      size_t maxItems)
 {
     std::vector<std::string> out;
-    std::regex rx(regexStr);
 
-    // Fetch and process RSS feeds for the given position.
-    auto urls = getFeedUrls(position);
+    // Process the lane's RSS feeds.
+    bool cacheChanged = false;
+    auto urls = getFeedUrls(feedsFile);
     for (auto &u : urls) {
-        std::string err; std::string xml = fetchUrl(u, err);
+        auto found = downloads.find(u);
+        if (found == downloads.end()) { out.push_back("[Feed Error] " + u + " - Not fetched"); continue; }
+        const Download &d = found->second;
+        const std::string &err = d.error;
         if (!err.empty()) { out.push_back("[Feed Error] " + u + " - " + err); continue; }
-        if (xml.empty()) { out.push_back("[Feed Error] " + u + " - Empty response"); continue; }
-        pugi::xml_document doc; pugi::xml_parse_result r = doc.load_buffer(xml.c_str(), xml.size());
-        if (!r) { out.push_back("[Parse Error] " + u + " - " + r.description()); continue; }
-        pugi::xml_node channel = doc.child("rss").child("channel");
-        for (pugi::xml_node item = channel.child("item"); item; item = item.next_sibling("item")) {
-            std::string title = item.child("title").child_value();
-            title = std::regex_replace(title, rx, "");
-            out.push_back(trim(title));
+        auto cached = cache_.find(u);
+        if (d.status == 304 && cached != cache_.end() && cached->second.maxItems == d.maxItems) {
+            // Not modified: the titles we have are current.
+            if (isDebug) std::cerr << "Not modified: " << u << std::endl;
+        } else {
+            if (d.bytes == 0) { out.push_back("[Feed Error] " + u + " - Empty response"); continue; }
+            if (!d.complete) { out.push_back("[Parse Error] " + u + " - Incomplete document"); continue; }
+            CachedFeed feed;
+            feed.etag = d.etag;
+            feed.lastModified = d.lastModified;
+            feed.maxItems = d.maxItems;
+            for (auto &item : d.items) feed.titles.push_back(item.title);
+            // Only a successful response can be revalidated later.
+            if (d.status != 200) { feed.etag.clear(); feed.lastModified.clear(); }
+            cached = cache_.insert(std::make_pair(u, CachedFeed())).first;
+            cached->second = std::move(feed);
+            cacheChanged = true;
+        }
+        // Another lane may have read more of the feed.
+        const std::vector<std::string> &titles = cached->second.titles;
+        size_t count = titles.size();
+        if (maxItems != 0 && maxItems < count) count = maxItems;
+        for (size_t i = 0; i < count; ++i) {
+            out.push_back(trim(filter.apply(titles[i])));
         }
     }
+    if (cacheChanged) saveCache();
 
-    // Add static lines for the given position.
-    auto statics = getStaticLines(position);
+    // Add the lane's static lines.
+    auto statics = getStaticLines(linesFile);
     out.insert(out.end(), statics.begin(), statics.end());
 
     return out;
@@ -1,11 +1,99 @@
 #pragma once
+#include "RssExtractor.h"
+#include "TitleFilter.h"
+#include <curl/curl.h>
+#include <map>
 #include <string>
 #include <vector>
 
-// Aggregates all message sources (RSS, static text, events) for a given position.
+// A URL to download. With a validator from an earlier response the server
+// can answer "not modified" instead of sending the same body again.
+struct FeedRequest {
+    std::string url;
+    std::string etag;           // Sent as If-None-Match, if not empty.
+    std::string lastModified;   // Sent as If-Modified-Since, if not empty.
+    size_t maxItems = 0;        // Stop after this many items; 0 for all.
+};
+
+// The outcome of downloading one URL: the items of the RSS document, or why
+// it failed.
+struct Download {
+    std::vector<FeedItem> items;
+    size_t bytes = 0;           // Received.
+    bool complete = false;      // Whole document read, or the item limit reached.
+    std::string error;          // Empty on success.
+    long status = 0;            // HTTP status; 304 if not modified.
+    size_t maxItems = 0;        // Item limit it was requested with; 0 for all.
+    std::string etag;           // Validators of the response, if any.
+    std::string lastModified;
+};
+
+// Downloads RSS feeds with libcurl, all of a batch at the same time. The
+// items are extracted while the bytes arrive; the documents aren't kept.
+// A transfer ends as soon as its request's item limit is reached. Keeps one
+// multi handle and a share handle for DNS, connections and TLS sessions
+// across batches, so repeated fetches of the same hosts skip the lookups and
+// handshakes. Not thread-safe; use from one thread at a time.
+class FeedFetcher {
+public:
+    FeedFetcher();
+    ~FeedFetcher();
+
+    // Initializes libcurl. Call once before any thread creates a fetcher.
+    static void globalInit();
+
+    // Downloads all "requests" in parallel; the time taken is that of the
+    // slowest. Returns the download of each distinct URL. A URL is requested
+    // once, as by its request with the highest item limit.
+    std::map<std::string, Download> fetch(const std::vector<FeedRequest> &requests);
+
+private:
+    FeedFetcher(const FeedFetcher &) = delete;
+    FeedFetcher &operator=(const FeedFetcher &) = delete;
+
+    CURLM *multi_;
+    CURLSH *share_;
+};
+
+// Aggregates all message sources (RSS, static text, events) of the lanes.
+// Keeps the titles of each feed with the validators of the response they came
+// from, so a feed that hasn't changed is neither downloaded nor parsed again.
 class MessageAggregator {
 public:
-    // Fetch all messages for position ("top" or "bottom") applying regex filtering for RSS titles.
-    // Returns combined list including error lines.
-    std::vector<std::string> fetchAll(const std::string &position, const std::string &regexStr);
+    // With a "cacheFile" (a file in Configs), the feed titles are kept there
+    // across restarts.
+    explicit MessageAggregator(const std::string &cacheFile = std::string());
+
+    // Requests for the feeds listed in "feedsFile" (a resource file in
+    // Configs, or empty for none). Only the first "maxItems" items of each
+    // feed are read; 0 for all. Conditional for the feeds we have titles of
+    // read with the same limit.
+    std::vector<FeedRequest> feedRequests(const std::string &feedsFile, size_t maxItems = 0);
+
+    // Combines the titles of the feeds listed in "feedsFile", taken from
+    // "downloads", with the static lines in "linesFile" (resource files in
+    // Configs, either may be empty), applying "filter" to the RSS titles.
+    // Feeds that were not modified keep their cached titles. Takes at most
+    // "maxItems" titles of each feed; 0 for all. Returns combined list
+    // including error lines.
+    std::vector<std::string> aggregate(const std::string &feedsFile, const std::string &linesFile,
+                                       const TitleFilter &filter,
+                                       const std::map<std::string, Download> &downloads,
+                                       size_t maxItems = 0);
+
+private:
+    // The titles of a feed as of the response with these validators, read
+    // up to the item limit.
+    struct CachedFeed {
+        std::string etag;
+        std::string lastModified;
+        size_t maxItems = 0;
+        std::vector<std::string> titles;
+    };
+
+    void loadCache();
+    void saveCache() const;
+
+    const std::string cacheFile_;
+    std::map<std::string, CachedFeed> cache_;   // By URL.
 };
@@ -0,0 +1,229 @@
+// RssExtractor.cpp: Implementation of streaming RSS item extraction for ScrollSignTest.
+// A small state machine over the XML syntax; it doesn't validate, but skips
+// comments, processing instructions, declarations and CDATA sections
+// correctly and unescapes the text of the fields it keeps.
+#include "RssExtractor.h"
+#include <cstdlib>
+#include <cstring>
+
+// Tag text we keep, enough for any element name; the attributes are skipped.
+static const size_t kMaxTag = 256;
+
+// Appends the UTF-8 encoding of "cp" to "out".
+static void appendUtf8(std::string &out, unsigned long cp)
+{
+    if (cp < 0x80) {
+        out += (char)cp;
+    } else if (cp < 0x800) {
+        out += (char)(0xC0 | (cp >> 6));
+        out += (char)(0x80 | (cp & 0x3F));
+    } else if (cp < 0x10000) {
+        out += (char)(0xE0 | (cp >> 12));
+        out += (char)(0x80 | ((cp >> 6) & 0x3F));
+        out += (char)(0x80 | (cp & 0x3F));
+    } else if (cp < 0x110000) {
+        out += (char)(0xF0 | (cp >> 18));
+        out += (char)(0x80 | ((cp >> 12) & 0x3F));
+        out += (char)(0x80 | ((cp >> 6) & 0x3F));
+        out += (char)(0x80 | (cp & 0x3F));
+    }
+}
+
+// Appends "raw" to "out", replacing the predefined entities and character
+// references. Anything else that looks like a reference is kept as is.
+static void appendUnescaped(std::string &out, const std::string &raw)
+{
+    static const struct { const char *name; char c; } kEntities[] = {
+        { "amp", '&' }, { "lt", '<' }, { "gt", '>' }, { "quot", '"' }, { "apos", '\'' }
+    };
+    size_t i = 0;
+    while (i < raw.size()) {
+        size_t amp = raw.find('&', i);
+        size_t semi = amp == std::string::npos ? amp : raw.find(';', amp);
+        if (semi == std::string::npos) { out.append(raw, i, std::string::npos); break; }
+        out.append(raw, i, amp - i);
+        std::string ref = raw.substr(amp + 1, semi - amp - 1);
+        bool replaced = false;
+        if (ref.size() > 1 && ref[0] == '#') {
+            char *end;
+            bool hex = ref[1] == 'x' || ref[1] == 'X';
+            unsigned long cp = strtoul(ref.c_str() + (hex ? 2 : 1), &end, hex ? 16 : 10);
+            if (*end == '\0' && cp != 0) { appendUtf8(out, cp); replaced = true; }
+        } else {
+            for (size_t e = 0; e < sizeof(kEntities)/sizeof(kEntities[0]); ++e) {
+                if (ref == kEntities[e].name) { out += kEntities[e].c; replaced = true; break; }
+            }
+        }
+        if (!replaced) { out += '&'; i = amp + 1; continue; }
+        i = semi + 1;
+    }
+}
+
+// Removes the XML white space around "s", e.g. the line breaks and
+// indentation around a CDATA section.
+static void trimSpace(std::string &s)
+{
+    static const char kSpace[] = " \t\r\n";
+    s.erase(0, s.find_first_not_of(kSpace));
+    s.erase(s.find_last_not_of(kSpace) + 1);
+}
+
+RssExtractor::RssExtractor(size_t maxItems)
+    : maxItems_(maxItems), done_(false), bytes_(0), state_(TEXT), quote_(0), lastTagChar_(0),
+      pending_(0), value_(nullptr)
+{
+}
+
+bool RssExtractor::feed(const char *data, size_t len)
+{
+    for (size_t i = 0; i < len && !done_; ++i) {
+        scan(data[i]);
+        ++bytes_;
+    }
+    return !done_;
+}
+
+void RssExtractor::scan(char c)
+{
+    switch (state_) {
+    case TEXT:
+        if (c == '<') {
+            state_ = MARKUP;
+            markup_.clear();
+        } else if (value_) {
+            raw_ += c;
+        }
+        break;
+
+    case MARKUP:
+        // Tell the kind of markup from its first characters.
+        markup_ += c;
+        if (markup_[0] == '?') {
+            state_ = PI;
+            pending_ = 0;
+        } else if (markup_[0] != '!') {
+            state_ = TAG;
+            tag_ = markup_;
+            quote_ = 0;
+            lastTagChar_ = c;
+            if (c == '>') handleTag();
+        } else if (markup_ == "!--") {
+            state_ = COMMENT;
+            pending_ = 0;
+        } else if (markup_ == "![CDATA[") {
+            state_ = CDATA;
+            pending_ = 0;
+            flushText();
+        } else if (strncmp("!--", markup_.c_str(), markup_.size()) != 0
+                   && strncmp("![CDATA[", markup_.c_str(), markup_.size()) != 0) {
+            // A declaration like <!DOCTYPE ...>, possibly with [ ... ] inside.
+            state_ = DECL;
+            pending_ = 0;
+            scan(c);
+        }
+        break;
+
+    case TAG:
+        if (quote_) {
+            if (c == quote_) quote_ = 0;
+        } else if (c == '"' || c == '\'') {
+            quote_ = c;
+        } else if (c == '>') {
+            handleTag();
+        } else {
+            if (tag_.size() < kMaxTag) tag_ += c;
+            if (c != ' ' && c != '\t' && c != '\r' && c != '\n') lastTagChar_ = c;
+        }
+        break;
+
+    case COMMENT:
+        // Ends at "-->".
+        if (c == '>' && pending_ >= 2) state_ = TEXT;
+        pending_ = c == '-' ? pending_ + 1 : 0;
+        break;
+
+    case CDATA:
+        // Ends at "]]>"; the text in between is taken as is.
+        if (c == ']') {
+            ++pending_;
+        } else if (c == '>' && pending_ >= 2) {
+            if (value_) value_->append(pending_ - 2, ']');
+            state_ = TEXT;
+        } else {
+            if (value_) { value_->append(pending_, ']'); *value_ += c; }
+            pending_ = 0;
+        }
+        break;
+
+    case PI:
+        // Ends at "?>".
+        if (c == '>' && pending_) state_ = TEXT;
+        pending_ = c == '?';
+        break;
+
+    case DECL:
+        // Ends at the first '>' outside of brackets.
+        if (c == '[') ++pending_;
+        else if (c == ']') --pending_;
+        else if (c == '>' && pending_ <= 0) state_ = TEXT;
+        break;
+    }
+}
+
+// Moves the text read so far into the field being read, unescaped.
+void RssExtractor::flushText()
+{
+    if (value_) appendUnescaped(*value_, raw_);
+    raw_.clear();
+}
+
+// The field of item_ to read for an element "name" directly inside the item,
+// or null if we don't want it. Only the first of each is kept.
+std::string *RssExtractor::field(const std::string &name)
+{
+    std::string *f = nullptr;
+    if (name == "title") f = &item_.title;
+    else if (name == "pubDate") f = &item_.pubDate;
+    else if (name == "guid") f = &item_.guid;
+    return f && f->empty() ? f : nullptr;
+}
+
+// Handles the tag just read into tag_, without its angle brackets.
+void RssExtractor::handleTag()
+{
+    state_ = TEXT;
+    bool end = !tag_.empty() && tag_[0] == '/';
+    size_t start = end ? 1 : 0;
+    size_t stop = tag_.find_first_of(" \t\r\n/>", start);
+    std::string name = tag_.substr(start, stop == std::string::npos ? std::string::npos : stop - start);
+    if (name.empty()) return;
+
+    if (!end) {
+        path_.push_back(name);
+        bool inItem = path_.size() == 4 && path_[0] == "rss" && path_[1] == "channel" && path_[2] == "item";
+        if (path_.size() == 3 && path_[0] == "rss" && path_[1] == "channel" && name == "item") item_ = FeedItem();
+        if (inItem) {
+            value_ = field(name);
+            raw_.clear();
+        }
+        if (lastTagChar_ != '/') return;
+        // An empty element: ends right away.
+    }
+
+    // Close the element; tolerate unbalanced tags by closing up to the
+    // innermost element of that name.
+    size_t depth = path_.size();
+    while (depth > 0 && path_[depth - 1] != name) --depth;
+    if (depth == 0) return;
+    if (value_ && depth == 4) {
+        flushText();
+        trimSpace(*value_);
+        value_ = nullptr;
+    }
+    if (depth == 3 && path_[0] == "rss" && path_[1] == "channel" && name == "item") {
+        items_.push_back(item_);
+        if (maxItems_ && items_.size() >= maxItems_) done_ = true;
+    }
+    path_.resize(depth - 1);
+    if (path_.empty()) done_ = true;
+}
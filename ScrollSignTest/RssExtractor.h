@@ -0,0 +1,60 @@
+// RssExtractor.h: Streaming RSS item extraction for ScrollSignTest.
+// Scans a feed as its bytes arrive and keeps only the few fields we show of
+// each rss/channel/item, instead of buffering the whole response to build a
+// DOM. Can stop after a number of items, so the rest need not be downloaded.
+#pragma once
+#include <cstddef>
+#include <string>
+#include <vector>
+
+// The fields of one feed item.
+struct FeedItem {
+    std::string title;
+    std::string pubDate;
+    std::string guid;
+};
+
+class RssExtractor {
+public:
+    // Extracts up to "maxItems" items; 0 for all of them.
+    explicit RssExtractor(size_t maxItems = 0);
+
+    // Scans the next "len" bytes of the document. Returns false once no more
+    // are needed: the item limit is reached or the document is complete.
+    bool feed(const char *data, size_t len);
+
+    // True once the root element has been closed or the item limit reached.
+    bool done() const { return done_; }
+
+    // Number of bytes scanned.
+    size_t bytes() const { return bytes_; }
+
+    // The items extracted so far, in document order.
+    std::vector<FeedItem> &items() { return items_; }
+
+private:
+    enum State { TEXT, MARKUP, TAG, COMMENT, CDATA, PI, DECL };
+
+    void scan(char c);
+    void handleTag();
+    void flushText();
+    std::string *field(const std::string &name);
+
+    const size_t maxItems_;
+    bool done_;
+    size_t bytes_;
+
+    State state_;
+    std::string markup_;        // Start of a markup construct, to tell which.
+    std::string tag_;           // Start and end tags, as far as we need them.
+    char quote_;                // Quote of the attribute value we are in, if any.
+    char lastTagChar_;          // Last non-space character of the tag.
+    int pending_;               // Matched characters of an end delimiter.
+
+    std::vector<std::string> path_;    // Names of the open elements.
+    FeedItem item_;             // Item being read.
+    std::string *value_;        // Field of item_ being read, if any.
+    std::string raw_;           // Its text not yet unescaped.
+
+    std::vector<FeedItem> items_;
+};
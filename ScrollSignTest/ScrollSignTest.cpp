@@ -8,17 +8,24 @@
 #include "pugixml.hpp"
 #include "MessageSources.h"
 #include "AnimationStrategies.h"
+#include "Compositor.h"
+#include "FrameClock.h"
+#include "FeedService.h"
+#include "TitleFilter.h"
 
 #include <getopt.h>
+#include <sys/inotify.h>
 #include <unistd.h>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <string>
 #include <vector>
+#include <map>
 #include <random>
-#include <thread>
+#include <memory>
 #include <algorithm>
+#include <functional>
 
 using namespace rgb_matrix;
 using std::string;
@@ -65,9 +72,22 @@ static string currentTime()
     return buf;
 }
 
-// Reads the regex string from Settings.xml for filtering messages.
+// One text lane of the sign as configured in Settings.xml: a band of pixel
+// rows with its own message sources and scroll speed.
+struct LaneConfig {
+    string name;
+    int y;
+    int height;
+    int speedMs;
+    string feedsFile;   // Feeds XML in Configs, or empty.
+    string linesFile;   // Static lines XML in Configs, or empty.
+    bool showTime;      // Append the time to messages that fit.
+    int maxItems;       // Items read of each feed; 0 for all.
+};
+
+// Finds Settings.xml. Returns null if it isn't there.
 // Updated to look inside Configs child folder where resources are copied on build.
-static string getRegexStr()
+static const char *settingsPath()
 {
 	const char *paths[] = {
 		"Configs/Settings.xml",		   // running from binary dir
@@ -75,76 +95,256 @@ static string getRegexStr()
         "Debug/Configs/Settings.xml",      // running from project root (Debug build)
         "Release/Configs/Settings.xml"     // running from project root (Release build)
     };
-    pugi::xml_document doc;
     for (size_t i = 0; i < sizeof(paths)/sizeof(paths[0]); ++i) {
-        if (doc.load_file(paths[i])) {
-            pugi::xml_node root = doc.child("settings");
-            return trim(root.child("regex").child("string").child_value());
-        }
+        if (access(paths[i], R_OK) == 0) return paths[i];
     }
-    return string();
+    return nullptr;
 }
 
-// Thread worker for displaying feeds/messages on one row of the matrix.
-static void displayFeeds(RGBMatrix *&canvas, const string &position, const string &fontFile, const Color &fixedColor, bool useFixedColor)
+// Loads Settings.xml into doc. Returns false if it can't be read.
+static bool loadSettings(pugi::xml_document &doc)
 {
-    Font font;
-    font.LoadFont(fontFile.c_str());
+    const char *path = settingsPath();
+    return path && doc.load_file(path);
+}
 
-    int y = (position == "top") ? 0 : 16;
-    int speed_ms = (position == "top") ? 11 : 14;
+// Reads the regex string from Settings.xml for filtering messages.
+static string getRegexStr()
+{
+    pugi::xml_document doc;
+    if (!loadSettings(doc)) return string();
+    pugi::xml_node root = doc.child("settings");
+    return trim(root.child("regex").child("string").child_value());
+}
 
-    MessageAggregator aggregator;
-    std::random_device rd; std::mt19937 gen(rd());
+// The title filter of Settings.xml, compiled when first needed and again only
+// after the file changed. Watches its folder with inotify, as editors often
+// replace the file instead of writing to it. Without a watch, the filter is
+// read again every time. Only used on the feed service thread.
+class WatchedFilter {
+public:
+    WatchedFilter() : inotify_(-1), stale_(true)
+    {
+        const char *path = settingsPath();
+        if (!path) return;
+        string p(path);
+        size_t slash = p.rfind('/');
+        string dir = slash == string::npos ? "." : p.substr(0, slash);
+        fileName_ = p.substr(slash + 1);
+        inotify_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (inotify_ >= 0 && inotify_add_watch(inotify_, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+            close(inotify_);
+            inotify_ = -1;
+        }
+    }
+    ~WatchedFilter() { if (inotify_ >= 0) close(inotify_); }
 
-    time_t lastFetch; time(&lastFetch);
-    bool firstPass = true;
-    std::vector<string> messages;
+    const TitleFilter &filter()
+    {
+        if (changed() || stale_) {
+            stale_ = inotify_ < 0;
+            filter_.compile(getRegexStr());
+            if (isDebug) fprintf(stderr, "Loaded the title filter%s.\n", filter_.usesRegex() ? " (std::regex)" : "");
+        }
+        return filter_;
+    }
 
-    while (true) {
-        // Periodically fetch new messages.
-        time_t now; time(&now);
-        double elapsed = difftime(now, lastFetch);
-        if (firstPass || elapsed > 120.0) {
-            lastFetch = now; firstPass = false;
-            string regexStr = getRegexStr();
-            messages = aggregator.fetchAll(position, regexStr);
-            if (position == "bottom") {
-                string timeStr = currentTime();
-                for (auto &m : messages) {
-                    int msg_len = (int)m.size() * 9;
-                    int msg_time_len = (int)(m.size() + timeStr.size()) * 9;
-                    if (msg_len < (canvas->width() - 1) && msg_time_len >= (canvas->width() - 1)) {
-                        // Only add time if original message already overflows
-                        continue;
-                    }
-                    m += timeStr;
+private:
+    // Reads all pending events. Returns true if one was about Settings.xml.
+    bool changed()
+    {
+        if (inotify_ < 0) return false;
+        bool settings = false;
+        char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+        ssize_t len;
+        while ((len = read(inotify_, buf, sizeof(buf))) > 0) {
+            for (char *p = buf; p < buf + len; ) {
+                const struct inotify_event *ev = (const struct inotify_event *)p;
+                if (ev->len && fileName_ == ev->name) settings = true;
+                p += sizeof(struct inotify_event) + ev->len;
+            }
+        }
+        return settings;
+    }
+
+    int inotify_;
+    string fileName_;
+    bool stale_;
+    TitleFilter filter_;
+};
+
+// Reads the lanes from Settings.xml. Without any configured, the display is
+// split into the classic top and bottom lane. Lanes that don't fit on the
+// display of the given height are left out.
+static std::vector<LaneConfig> getLanes(int displayHeight)
+{
+    std::vector<LaneConfig> lanes;
+    pugi::xml_document doc;
+    if (loadSettings(doc)) {
+        pugi::xml_node root = doc.child("settings").child("lanes");
+        for (pugi::xml_node n = root.child("lane"); n; n = n.next_sibling("lane")) {
+            LaneConfig lane;
+            lane.name = n.attribute("name").as_string();
+            lane.y = n.attribute("y").as_int(-1);
+            lane.height = n.attribute("height").as_int(0);
+            lane.speedMs = n.attribute("speed").as_int(11);
+            lane.feedsFile = n.attribute("feeds").as_string();
+            lane.linesFile = n.attribute("lines").as_string();
+            lane.showTime = n.attribute("time").as_bool(false);
+            lane.maxItems = std::max(0, n.attribute("items").as_int(0));
+            if (lane.name.empty()) lane.name = "lane " + std::to_string(lanes.size() + 1);
+            if (lane.y < 0 || lane.height <= 0 || lane.y + lane.height > displayHeight) {
+                fprintf(stderr, "Lane '%s' (y=%d, height=%d) doesn't fit the display of %d rows; skipped.\n",
+                        lane.name.c_str(), lane.y, lane.height, displayHeight);
+                continue;
+            }
+            lanes.push_back(lane);
+        }
+    }
+    if (lanes.empty()) {
+        int half = displayHeight / 2;
+        lanes.push_back({"top", 0, half, 11, "TopFeeds.xml", "TopLines.xml", false, 0});
+        lanes.push_back({"bottom", half, displayHeight - half, 14, "BottomFeeds.xml", "BottomLines.xml", true, 0});
+    }
+    return lanes;
+}
+
+// Prepares the messages for one lane from the downloaded feeds. Runs on the
+// feed service thread so the display keeps animating while feeds are
+// downloaded.
+static std::vector<string> buildMessages(MessageAggregator &aggregator, WatchedFilter &filter,
+                                         const LaneConfig &lane, int width, const Font &font,
+                                         const std::map<string, Download> &downloads)
+{
+    std::vector<string> messages = aggregator.aggregate(lane.feedsFile, lane.linesFile, filter.filter(),
+                                                        downloads, lane.maxItems);
+    if (lane.showTime) {
+        string timeStr = currentTime();
+        for (auto &m : messages) {
+            int msg_len = rgb_matrix::MeasureText(font, m.c_str());
+            int msg_time_len = msg_len + rgb_matrix::MeasureText(font, timeStr.c_str());
+            if (msg_len < (width - 1) && msg_time_len >= (width - 1)) {
+                // Only add time if original message already overflows
+                continue;
+            }
+            m += timeStr;
+        }
+    }
+    return messages;
+}
+
+// The independent timeline of one lane of the sign: cycles through the lane's
+// messages, animating each with a randomly chosen strategy. Switches to the
+// newest messages of the feed service between two messages.
+class LaneTimeline {
+public:
+    LaneTimeline(const LaneConfig &lane, const FeedService &feeds, int source,
+                 const Font &font, const Color &fixedColor, bool useFixedColor)
+        : lane_(lane), feeds_(feeds), source_(source), font_(font),
+          fixedColor_(fixedColor), useFixedColor_(useFixedColor),
+          gen_(std::random_device()()), generation_(0), next_(0), startMs_(0), dueMs_(0) {}
+
+    // Time at which the lane wants to show its next frame.
+    int64_t dueMs() const { return dueMs_; }
+
+    // Draws the lane as it looks at time "now" into the compositor. Returns
+    // false if the lane has not changed.
+    bool advance(Compositor &compositor, int64_t now)
+    {
+        bool changed = false;
+        while (true) {
+            if (strategy_) {
+                int64_t next_ms = strategy_->render(compositor.beginLane(lane_.y, lane_.height), now - startMs_);
+                changed = true;
+                if (next_ms >= 0) {
+                    dueMs_ = startMs_ + next_ms;
+                    return true;
                 }
+                // Finished; the lane has been cleared.
+                strategy_.reset();
             }
-            std::shuffle(messages.begin(), messages.end(), gen);
-            if (isDebug) fprintf(stderr, "Fetched %zu messages for %s row.\n", messages.size(), position.c_str());
+            if (!nextMessage(compositor, now)) return changed;
+        }
+    }
+
+private:
+    // Picks up fetched messages and starts animating the next one. Returns
+    // false, with the next check scheduled, if there is nothing to show.
+    bool nextMessage(Compositor &compositor, int64_t now)
+    {
+        // Pick up the newest snapshot, if there is one we haven't seen.
+        std::shared_ptr<const MessageSnapshot> snapshot = feeds_.latest(source_);
+        if (snapshot && snapshot->generation != generation_) {
+            generation_ = snapshot->generation;
+            messages_ = snapshot->messages;
+            std::shuffle(messages_.begin(), messages_.end(), gen_);
+            next_ = 0;
+            if (isDebug) fprintf(stderr, "Fetched %zu messages for %s lane.\n", messages_.size(), lane_.name.c_str());
         }
 
-        if (messages.empty()) {
-            if (isDebug) fprintf(stderr, "No messages for %s row. Sleeping 5s.\n", position.c_str());
-            usleep(5 * 1000 * 1000);
-            continue;
+        if (messages_.empty()) {
+            // Still waiting for the first fetch, or nothing to show: check again later.
+            if (generation_ != 0 && isDebug) fprintf(stderr, "No messages for %s lane. Sleeping 5s.\n", lane_.name.c_str());
+            dueMs_ = now + (generation_ == 0 ? 100 : 5 * 1000);
+            return false;
         }
 
         // Display each message using the chosen animation strategy.
-        for (const auto &msg : messages) {
-            int draw_len = (int)msg.size() * 9;
-            bool fits = draw_len < (canvas->width() - 1);
-            Color drawColor(0,0,0);
-            if (useFixedColor) {
-                drawColor = fixedColor;
-            } else {
-                int r = gen() % 255, g = gen() % 255, b = gen() % 255;
-                while (r + g + b < 50) { r = gen() % 255; g = gen() % 255; b = gen() % 255; }
-                drawColor = Color(r,g,b);
-            }
-            auto strategy = chooseStrategy(fits, gen);
-            strategy->render(canvas, font, msg, y, drawColor, speed_ms);
+        const string &msg = messages_[next_];
+        next_ = (next_ + 1) % messages_.size();
+        int draw_len = rgb_matrix::MeasureText(font_, msg.c_str());
+        bool fits = draw_len < (compositor.width() - 1);
+        Color drawColor(0,0,0);
+        if (useFixedColor_) {
+            drawColor = fixedColor_;
+        } else {
+            int r = gen_() % 255, g = gen_() % 255, b = gen_() % 255;
+            while (r + g + b < 50) { r = gen_() % 255; g = gen_() % 255; b = gen_() % 255; }
+            drawColor = Color(r,g,b);
+        }
+        strategy_ = chooseStrategy(fits, gen_);
+        strategy_->start(font_, msg, lane_.y, drawColor, lane_.speedMs, compositor.width(), lane_.height);
+        startMs_ = now;
+        return true;
+    }
+
+    const LaneConfig lane_;
+    const FeedService &feeds_;
+    const int source_;
+    const Font &font_;
+    const Color fixedColor_;
+    const bool useFixedColor_;
+    std::mt19937 gen_;
+
+    unsigned generation_;   // Of the snapshot messages_ came from; 0 before the first.
+    std::vector<string> messages_;
+    size_t next_;
+
+    std::unique_ptr<AnimationStrategy> strategy_;
+    int64_t startMs_;   // When the current animation started.
+    int64_t dueMs_;
+};
+
+// Frame scheduler: redraws every lane whose frame is due, composites the lanes
+// into one frame and publishes it, then sleeps until the next lane is due.
+// Deadlines are absolute, so the lanes keep their exact speed whatever the
+// drawing time; a missed deadline just shows that lane's next frame late.
+static void runScheduler(Compositor &compositor, std::vector<LaneTimeline> &lanes)
+{
+    FrameClock clock;
+    while (true) {
+        int64_t now = clock.nowMs();
+        bool changed = false;
+        for (auto &lane : lanes) {
+            if (now >= lane.dueMs()) changed |= lane.advance(compositor, now);
+        }
+        if (changed) compositor.present();
+
+        int64_t next = lanes.front().dueMs();
+        for (const auto &lane : lanes) next = std::min(next, lane.dueMs());
+        if (!clock.sleepUntil(next) && isDebug) {
+            fprintf(stderr, "Missed frame deadline by %lldms (%u missed so far).\n",
+                    (long long)clock.lastLatenessMs(), clock.missedDeadlines());
         }
     }
 }
@@ -183,16 +383,37 @@ int main(int argc, char *argv[])
     }
 
     // Validate font file early.
-    Font testFont; if (!testFont.LoadFont(fontPath.c_str())) { fprintf(stderr, "Couldn't load font '%s'\n", fontPath.c_str()); return usage(argv[0]); }
+    Font font; if (!font.LoadFont(fontPath.c_str())) { fprintf(stderr, "Couldn't load font '%s'\n", fontPath.c_str()); return usage(argv[0]); }
 
+    // Full color depth: the refresh leaves out the empty low bitplanes of
+    // each frame by itself.
     canvas->SetBrightness(brightness);
-    canvas->SetPWMBits(8); // reduced color depth for performance
 
-    // Start threads for top and bottom rows.
-    std::thread topThread(displayFeeds, std::ref(canvas), "top", fontPath, textColor, colorSpecified);
-    std::thread bottomThread(displayFeeds, std::ref(canvas), "bottom", fontPath, textColor, colorSpecified);
-    topThread.join();
-    bottomThread.join();
+    // All drawing goes through the compositor's off-screen buffers; created
+    // after the brightness setting so its buffers inherit it.
+    Compositor compositor(canvas);
+
+    // One scheduler drives all lanes as independent timelines. The display
+    // height covers the panels of all parallel chains. Their messages are
+    // refreshed every two minutes by the feed service; feeds that haven't
+    // changed since are answered from the aggregator's cache. Changes to the
+    // title filter in Settings.xml apply from the next refresh; the lanes are
+    // only read at start.
+    MessageAggregator aggregator("FeedCache.xml");
+    WatchedFilter filter;
+    FeedService feeds(120 * 1000);
+    std::vector<LaneTimeline> lanes;
+    const int width = canvas->width();
+    for (const LaneConfig &lane : getLanes(canvas->height())) {
+        int source = feeds.addSource(
+            [lane, &aggregator]() { return aggregator.feedRequests(lane.feedsFile, lane.maxItems); },
+            [lane, width, &font, &aggregator, &filter](const std::map<string, Download> &downloads) {
+                return buildMessages(aggregator, filter, lane, width, font, downloads);
+            });
+        lanes.emplace_back(lane, feeds, source, font, textColor, colorSpecified);
+    }
+    feeds.start();
+    runScheduler(compositor, lanes);
 
     canvas->Clear();
     delete canvas;
@@ -0,0 +1,81 @@
+// TextStrip.cpp: Implementation of pre-rendered text for ScrollSignTest.
+#include "TextStrip.h"
+#include <algorithm>
+#include <cassert>
+#include <climits>
+
+namespace {
+// Canvas that just remembers which pixels were set, to rasterize text once.
+class RecordingCanvas : public Canvas {
+public:
+    int width() const override { return INT_MAX; }
+    int height() const override { return INT_MAX; }
+    void SetPixel(int x, int y, uint8_t, uint8_t, uint8_t) override {
+        pixels.push_back(std::make_pair(x, y));
+    }
+    void Clear() override { pixels.clear(); }
+    void Fill(uint8_t, uint8_t, uint8_t) override {}
+
+    std::vector<std::pair<int, int> > pixels;
+};
+}
+
+TextStrip::TextStrip(const Font &font, const string &text)
+    : width_(0), height_(font.height()), words_per_row_(0)
+{
+    assert(height_ > 0);   // Font loaded ?
+    RecordingCanvas recorder;
+    width_ = rgb_matrix::DrawText(&recorder, font, 0, font.baseline(), Color(0,0,0), nullptr, text.c_str());
+    for (const auto &p : recorder.pixels) width_ = std::max(width_, p.first + 1);
+
+    words_per_row_ = (width_ + 31) / 32;
+    bits_.assign(words_per_row_ * height_, 0);
+    for (const auto &p : recorder.pixels) {
+        if (p.first < 0 || p.second < 0 || p.second >= height_) continue;
+        bits_[p.second * words_per_row_ + p.first / 32] |= 0x80000000u >> (p.first % 32);
+    }
+}
+
+uint32_t TextStrip::bitsAt(int row, int col) const
+{
+    const uint32_t *line = &bits_[row * words_per_row_];
+    // Split into word index and bit offset, rounding towards negative.
+    int word = (col >= 0) ? col / 32 : -((31 - col) / 32);
+    int shift = col - word * 32;
+    uint32_t hi = (word >= 0 && word < words_per_row_) ? line[word] : 0;
+    if (shift == 0) return hi;
+    uint32_t lo = (word + 1 >= 0 && word + 1 < words_per_row_) ? line[word + 1] : 0;
+    return (hi << shift) | (lo >> (32 - shift));
+}
+
+void TextStrip::draw(Canvas *canvas, int x, int y, const Color &color) const
+{
+    const int first = std::max(0, x);
+    const int last = std::min(canvas->width(), x + width_);   // exclusive
+    // Hand the canvas one 32 column wide slice of all rows at a time.
+    std::vector<uint32_t> slice(height_);
+    for (int dx = first; dx < last; dx += 32) {
+        const int columns = std::min(32, last - dx);
+        for (int row = 0; row < height_; ++row) slice[row] = bitsAt(row, dx - x);
+        canvas->SetBitmap(dx, y, columns, height_, slice.data(), color.r, color.g, color.b);
+    }
+}
+
+std::shared_ptr<const TextStrip> TextStripCache::get(const Font &font, const string &text)
+{
+    Key key(&font, text);
+    auto found = entries_.find(key);
+    if (found != entries_.end()) {
+        lru_.splice(lru_.begin(), lru_, found->second.lru);
+        return found->second.strip;
+    }
+    if (entries_.size() >= capacity_) {
+        entries_.erase(lru_.back());
+        lru_.pop_back();
+    }
+    lru_.push_front(key);
+    Entry &entry = entries_[key];
+    entry.strip = std::make_shared<TextStrip>(font, text);
+    entry.lru = lru_.begin();
+    return entry.strip;
+}
@@ -0,0 +1,62 @@
+// TextStrip.h: Pre-rendered text for ScrollSignTest.
+// A message is rasterized once into a packed one-bit-per-pixel strip; drawing
+// it at any horizontal offset is then a windowed copy of the strip instead of
+// decoding, looking up and drawing every glyph again.
+#pragma once
+#include "graphics.h"
+#include <cstdint>
+#include <list>
+#include <map>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+using namespace rgb_matrix;
+using std::string;
+
+class TextStrip {
+public:
+    // Rasterizes "text" (UTF-8) with the given font. The strip is as high as
+    // the font and as wide as the text advances.
+    TextStrip(const Font &font, const string &text);
+
+    int width() const { return width_; }
+    int height() const { return height_; }
+
+    // Draws the strip in "color" with its top left corner at x, y. Only the
+    // columns that fall onto the canvas are visited.
+    void draw(Canvas *canvas, int x, int y, const Color &color) const;
+
+private:
+    // Row "row", 32 columns starting at column "col" (which may be
+    // negative or beyond the end), MSB leftmost.
+    uint32_t bitsAt(int row, int col) const;
+
+    int width_;
+    int height_;
+    int words_per_row_;
+    std::vector<uint32_t> bits_;   // Row-major, MSB is the leftmost pixel.
+};
+
+// Keeps the strips of the most recently shown messages. Strips carry no
+// color, so a message shown again in a different color is still a hit.
+class TextStripCache {
+public:
+    explicit TextStripCache(size_t capacity) : capacity_(capacity) {}
+
+    // Returns the strip for "text" in "font", rasterizing it if needed.
+    std::shared_ptr<const TextStrip> get(const Font &font, const string &text);
+
+private:
+    typedef std::pair<const Font *, string> Key;
+    typedef std::list<Key> LruList;
+    struct Entry {
+        std::shared_ptr<const TextStrip> strip;
+        LruList::iterator lru;
+    };
+
+    const size_t capacity_;
+    LruList lru_;   // Most recently used first.
+    std::map<Key, Entry> entries_;
+};
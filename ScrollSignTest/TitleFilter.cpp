@@ -0,0 +1,226 @@
+// TitleFilter.cpp: Implementation of fast removal of unwanted text from feed titles for ScrollSignTest.
+#include "TitleFilter.h"
+#include <cstdio>
+
+extern int isDebug;
+
+// Word characters for \b, as ECMAScript defines them.
+static bool isWordByte(unsigned char c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_';
+}
+
+static bool isQuantifier(char c)
+{
+    return c == '*' || c == '+' || c == '?' || c == '{';
+}
+
+// Decodes the escape "\c" standing for a single byte. Returns -1 for any other
+// escape, like classes, assertions and back references.
+static int escapedByte(char c)
+{
+    switch (c) {
+    case 'r': return '\r';
+    case 'n': return '\n';
+    case 't': return '\t';
+    case 'f': return '\f';
+    case 'v': return '\v';
+    }
+    if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')) return -1;
+    return (unsigned char)c;
+}
+
+TitleFilter::TitleFilter()
+{
+}
+
+bool TitleFilter::compile(const std::string &pattern)
+{
+    alternatives_.clear();
+    for (auto &list : byFirstByte_) list.clear();
+    regex_.reset();
+    if (pattern.empty()) return true;
+
+    // Split into the top level alternatives; any nested alternation or
+    // unsupported syntax makes us use the regex.
+    std::vector<std::string> parts;
+    bool simple = true;
+    size_t start = 0;
+    int depth = 0;
+    bool inClass = false;
+    for (size_t i = 0; i < pattern.size() && simple; ++i) {
+        char c = pattern[i];
+        if (c == '\\') { ++i; continue; }
+        if (inClass) { if (c == ']') inClass = false; continue; }
+        if (c == '[') inClass = true;
+        else if (c == '(') ++depth;
+        else if (c == ')') --depth;
+        else if (c == '|') {
+            if (depth != 0) simple = false;
+            parts.push_back(pattern.substr(start, i - start));
+            start = i + 1;
+        }
+    }
+    parts.push_back(pattern.substr(start));
+
+    for (size_t i = 0; i < parts.size() && simple; ++i) {
+        Alternative alt;
+        simple = parseAlternative(parts[i], &alt);
+        if (simple) alternatives_.push_back(alt);
+    }
+
+    if (simple) {
+        for (size_t i = 0; i < alternatives_.size(); ++i) {
+            for (int e : alternatives_[i].elements) {
+                if (e != kBoundary) { byFirstByte_[e].push_back((int)i); break; }
+            }
+        }
+        return true;
+    }
+
+    alternatives_.clear();
+    try {
+        regex_.reset(new std::regex(pattern));
+    } catch (const std::regex_error &e) {
+        fprintf(stderr, "Invalid filter regex, not filtering: %s\n", e.what());
+        return false;
+    }
+    if (isDebug) fprintf(stderr, "Filter regex isn't a simple alternation; using std::regex.\n");
+    return true;
+}
+
+// Parses one alternative: literals, escaped bytes, \b and groups of these,
+// optionally ending in a character class with '*'. Returns false for anything
+// else, or if it could match the empty string.
+bool TitleFilter::parseAlternative(const std::string &s, Alternative *alt)
+{
+    alt->hasTail = false;
+    int depth = 0;
+    bool literal = false;
+    size_t i = 0;
+    while (i < s.size()) {
+        char c = s[i];
+        if (c == ')') {
+            // A group just matches its content, unless repeated.
+            if (--depth < 0) return false;
+            ++i;
+            if (i < s.size() && isQuantifier(s[i])) return false;
+            continue;
+        }
+        if (alt->hasTail) return false;     // Only group ends after the tail.
+        if (c == '(') {
+            if (s.compare(i, 3, "(?:") == 0) i += 3;
+            else if (i + 1 < s.size() && s[i + 1] == '?') return false;
+            else ++i;
+            ++depth;
+            continue;
+        }
+        if (c == '[') {
+            // Only a class repeated with '*' as the tail.
+            bool negate = s.compare(i, 2, "[^") == 0;
+            i += negate ? 2 : 1;
+            std::bitset<256> set;
+            int prev = -1;
+            while (i < s.size() && s[i] != ']') {
+                int b = (unsigned char)s[i];
+                if (s[i] == '\\') {
+                    if (++i == s.size()) return false;
+                    b = escapedByte(s[i]);
+                    if (b < 0) return false;
+                }
+                ++i;
+                if (prev >= 0 && b == '-' && i < s.size() && s[i] != ']') {
+                    int to = (unsigned char)s[i];
+                    if (s[i] == '\\') {
+                        if (++i == s.size()) return false;
+                        to = escapedByte(s[i]);
+                        if (to < 0) return false;
+                    }
+                    ++i;
+                    if (to < prev) return false;
+                    for (int r = prev; r <= to; ++r) set.set(r);
+                    prev = -1;
+                    continue;
+                }
+                set.set(b);
+                prev = b;
+            }
+            if (i == s.size()) return false;
+            ++i;
+            if (i >= s.size() || s[i] != '*') return false;
+            ++i;
+            if (i < s.size() && isQuantifier(s[i])) return false;
+            alt->hasTail = true;
+            alt->tail = negate ? ~set : set;
+            continue;
+        }
+        int b;
+        if (c == '\\') {
+            if (++i == s.size()) return false;
+            if (s[i] == 'b') {
+                alt->elements.push_back(kBoundary);
+                ++i;
+                continue;
+            }
+            b = escapedByte(s[i]);
+            if (b < 0) return false;
+        } else if (c == '.' || c == '^' || c == '$' || c == ']' || c == '}' || isQuantifier(c)) {
+            return false;
+        } else {
+            b = (unsigned char)c;
+        }
+        ++i;
+        if (i < s.size() && isQuantifier(s[i])) return false;
+        alt->elements.push_back(b);
+        literal = true;
+    }
+    return depth == 0 && literal;
+}
+
+// Returns the end of the match of "alt" at "pos" in "text", or 0 if none.
+size_t TitleFilter::matchAt(const Alternative &alt, const std::string &text, size_t pos) const
+{
+    for (int e : alt.elements) {
+        if (e == kBoundary) {
+            bool before = pos > 0 && isWordByte(text[pos - 1]);
+            bool after = pos < text.size() && isWordByte(text[pos]);
+            if (before == after) return 0;
+        } else {
+            if (pos >= text.size() || (unsigned char)text[pos] != e) return 0;
+            ++pos;
+        }
+    }
+    if (alt.hasTail) {
+        while (pos < text.size() && alt.tail.test((unsigned char)text[pos])) ++pos;
+    }
+    return pos;
+}
+
+// Like regex_replace(): the leftmost match is removed, of the alternatives
+// matching there the first, and the search goes on behind it.
+std::string TitleFilter::apply(const std::string &title) const
+{
+    if (regex_) return std::regex_replace(title, *regex_, "");
+    if (alternatives_.empty()) return title;
+
+    std::string out;
+    size_t copied = 0;
+    size_t pos = 0;
+    while (pos < title.size()) {
+        size_t end = 0;
+        for (int a : byFirstByte_[(unsigned char)title[pos]]) {
+            // The alternative's first byte may come after word boundaries.
+            end = matchAt(alternatives_[a], title, pos);
+            if (end) break;
+        }
+        if (end) {
+            out.append(title, copied, pos - copied);
+            copied = pos = end;
+        } else {
+            ++pos;
+        }
+    }
+    if (copied == 0) return title;
+    out.append(title, copied, std::string::npos);
+    return out;
+}
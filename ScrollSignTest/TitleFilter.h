@@ -0,0 +1,46 @@
+// TitleFilter.h: Fast removal of unwanted text from feed titles for ScrollSignTest.
+// The filter is a regular expression whose matches are removed from every
+// title. The usual filters are alternations of literal strings, like airport
+// name suffixes, and a literal prefix followed by a character class run, like
+// a URL; those are compiled into a matcher that looks up the alternatives by
+// their first byte. Anything else falls back to std::regex. Both remove the
+// same text as std::regex_replace(title, std::regex(pattern), "").
+#pragma once
+#include <bitset>
+#include <memory>
+#include <regex>
+#include <string>
+#include <vector>
+
+class TitleFilter {
+public:
+    // A filter that removes nothing.
+    TitleFilter();
+
+    // Compiles "pattern", an ECMAScript regular expression. Returns false if
+    // it isn't valid; the filter then removes nothing.
+    bool compile(const std::string &pattern);
+
+    // Returns "title" without any matches of the pattern.
+    std::string apply(const std::string &title) const;
+
+    // True if the pattern needed std::regex.
+    bool usesRegex() const { return regex_ != nullptr; }
+
+private:
+    // One alternative of the pattern: literal bytes and word boundaries
+    // (kBoundary), then possibly a run of bytes out of "tail".
+    struct Alternative {
+        std::vector<int> elements;
+        bool hasTail;
+        std::bitset<256> tail;
+    };
+    enum { kBoundary = -1 };
+
+    bool parseAlternative(const std::string &s, Alternative *alt);
+    size_t matchAt(const Alternative &alt, const std::string &text, size_t pos) const;
+
+    std::vector<Alternative> alternatives_;
+    std::vector<int> byFirstByte_[256];     // Indices of the alternatives, in order.
+    std::unique_ptr<std::regex> regex_;     // Fallback, if set.
+};
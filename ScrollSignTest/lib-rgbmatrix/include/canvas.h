@@ -46,6 +46,47 @@ public:
 
   // Fill screen with given 24bpp color.
   virtual void Fill(uint8_t red, uint8_t green, uint8_t blue) = 0;
+
+  // Set the "width" x "height" pixels at (x,y) from packed 24bpp RGB data,
+  // three bytes per pixel; row "r" of the data starts at rgb + r * stride.
+  // Pixels outside the canvas are skipped. Canvases that can do better
+  // than one SetPixel() per pixel override this.
+  virtual void SetPixels(int x, int y, int width, int height,
+                         const uint8_t *rgb, int stride) {
+    for (int row = 0; row < height; ++row) {
+      const uint8_t *pixel = rgb + row * stride;
+      for (int col = 0; col < width; ++col, pixel += 3) {
+        SetPixel(x + col, y + row, pixel[0], pixel[1], pixel[2]);
+      }
+    }
+  }
+
+  // Fill the "width" x "height" rectangle at (x,y) with the given color.
+  virtual void FillRect(int x, int y, int width, int height,
+                        uint8_t red, uint8_t green, uint8_t blue) {
+    for (int row = 0; row < height; ++row) {
+      for (int col = 0; col < width; ++col) {
+        SetPixel(x + col, y + row, red, green, blue);
+      }
+    }
+  }
+
+  // Set the pixels of a one-bit-per-pixel bitmap at (x,y) to the given
+  // color; pixels with a zero bit are left as they are. "rows" has "height"
+  // entries, in each the most significant bit is the pixel at "x" and
+  // the following "width" (at most 32) bits are the pixels right of it.
+  // This is how text is drawn. The default just calls SetPixel(); canvases
+  // that can map the color once for all pixels override it.
+  virtual void SetBitmap(int x, int y, int width, int height,
+                         const uint32_t *rows,
+                         uint8_t red, uint8_t green, uint8_t blue) {
+    for (int row = 0; row < height; ++row) {
+      uint32_t x_mask = 0x80000000;
+      for (int col = 0; col < width; ++col, x_mask >>= 1) {
+        if (rows[row] & x_mask) SetPixel(x + col, y + row, red, green, blue);
+      }
+    }
+  }
 };
 
 // A canvas transformer is an object that, given a Canvas, returns a
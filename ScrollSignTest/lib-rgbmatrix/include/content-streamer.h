@@ -4,6 +4,7 @@
 #include <stdlib.h>
 
 #include <string>
+#include <vector>
 
 namespace rgb_matrix {
 class FrameCanvas;
@@ -55,6 +56,8 @@ public:
 
   // Stream out given canvas at the given time. "hold_time_us" indicates
   // for how long this frame is to be shown in microseconds.
+  // If it is the same canvas as streamed before, only the parts that have
+  // been written to since are stored.
   bool Stream(const FrameCanvas &frame, uint32_t hold_time_us);
 
 private:
@@ -62,6 +65,10 @@ private:
 
   StreamIO *const io_;
   bool header_written_;
+
+  // The framebuffer serial and row generations of the last frame streamed.
+  uint32_t last_serial_;
+  std::vector<uint32_t> last_generations_;
 };
 
 class StreamReader {
@@ -87,6 +94,7 @@ private:
 
   StreamIO *io_;
   size_t buf_size_;
+  size_t row_size_;  // Size of each row of partial frames.
   State state_;
 
   char *buffer_;
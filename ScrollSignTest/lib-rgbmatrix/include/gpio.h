@@ -16,6 +16,7 @@
 #ifndef RPI_GPIO_H
 #define RPI_GPIO_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 #include <vector>
@@ -23,6 +24,83 @@
 // Putting this in our namespace to not collide with other things called like
 // this.
 namespace rgb_matrix {
+// Stand-in for the GPIO registers on hosts that are not a Raspberry Pi, so
+// that the refresh can be profiled and its output checked on any Linux box.
+// Register writes and output-enable pulses are recorded in a ring buffer,
+// stamped with a simulated time: each register write takes
+// "write_nanoseconds", each pulse the time requested from the PinPulser.
+//
+// Only the refresh thread records; other threads can look at the recent
+// events with CopyEvents() at any time.
+class GPIOSimulator {
+ public:
+  enum EventType { SET_BITS, CLEAR_BITS, PULSE, REFRESH };
+  struct Event {
+    int64_t time_ns;  // Simulated time at which the event started.
+    uint32_t value;   // SET_BITS, CLEAR_BITS: the bits. PULSE: nanoseconds.
+    uint8_t type;     // One of EventType.
+    uint8_t pulse;    // PULSE: index of the PinPulser timing.
+  };
+
+  // Keeps the last "capacity" events; rounded up to a power of two.
+  GPIOSimulator(int capacity, int write_nanoseconds);
+  ~GPIOSimulator();
+
+  // Record "bits" set or cleared with "register_writes" writes.
+  inline void Write(EventType type, uint32_t bits, int register_writes) {
+    Append(type, bits, 0);
+    Advance(register_writes * write_ns_);
+  }
+
+  // Record an output enable pulse of "nanos" starting now. Like the hardware
+  // pulses, it runs in the background: simulated time only moves on with
+  // the following writes, or WaitUntil().
+  void Pulse(int index, int nanos) { Append(PULSE, nanos, index); }
+
+  // Record the start of a refresh, so that decoding knows where a complete
+  // one begins and ends.
+  void MarkRefresh() { Append(REFRESH, 0, 0); }
+
+  // Advance the simulated time to "time_ns" unless already past it.
+  void WaitUntil(int64_t time_ns) {
+    if (time_ns > now_ns_) Advance(time_ns - now_ns_);
+  }
+
+  // Simulated nanoseconds passed since creation.
+  int64_t now_ns() const { return __atomic_load_n(&now_ns_, __ATOMIC_RELAXED); }
+
+  // Number of events recorded since creation.
+  uint64_t events_recorded() const {
+    return __atomic_load_n(&recorded_, __ATOMIC_ACQUIRE);
+  }
+
+  // Replaces "events" with up to "max_events" of the most recent events
+  // still in the ring buffer, oldest first. Copying fewer than the capacity
+  // leaves room for the events recorded while copying.
+  void CopyEvents(size_t max_events, std::vector<Event> *events) const;
+
+ private:
+  GPIOSimulator(const GPIOSimulator &);  // Not copyable.
+
+  inline void Append(EventType type, uint32_t value, int pulse) {
+    Event *e = &events_[recorded_ & mask_];
+    e->time_ns = now_ns_;
+    e->value = value;
+    e->type = type;
+    e->pulse = pulse;
+    __atomic_store_n(&recorded_, recorded_ + 1, __ATOMIC_RELEASE);
+  }
+  inline void Advance(int64_t nanos) {
+    __atomic_store_n(&now_ns_, now_ns_ + nanos, __ATOMIC_RELAXED);
+  }
+
+  Event *const events_;
+  const uint64_t mask_;
+  const int write_ns_;
+  uint64_t recorded_;
+  int64_t now_ns_;
+};
+
 // For now, everything is initialized as output.
 class GPIO {
  public:
@@ -41,6 +119,15 @@ class GPIO {
 #endif
             );
 
+  // Initialize to send all output to "simulator" instead of the hardware,
+  // e.g. on a host that is not a Raspberry Pi. The "slowdown" only scales
+  // the simulated time. The simulator is not owned and has to outlive this
+  // GPIO. Always returns 'true'.
+  bool InitSimulated(GPIOSimulator *simulator, int slowdown);
+
+  // The simulator given to InitSimulated(), or NULL.
+  GPIOSimulator *simulator() const { return simulator_; }
+
   // Initialize outputs.
   // Returns the bits that are actually set.
   uint32_t InitOutputs(uint32_t outputs);
@@ -48,6 +135,10 @@ class GPIO {
   // Set the bits that are '1' in the output. Leave the rest untouched.
   inline void SetBits(uint32_t value) {
     if (!value) return;
+    if (__builtin_expect(simulator_ != NULL, 0)) {
+      simulator_->Write(GPIOSimulator::SET_BITS, value, slowdown_ + 1);
+      return;
+    }
     *gpio_set_bits_ = value;
     for (int i = 0; i < slowdown_; ++i) {
       *gpio_set_bits_ = value;
@@ -57,6 +148,10 @@ class GPIO {
   // Clear the bits that are '1' in the output. Leave the rest untouched.
   inline void ClearBits(uint32_t value) {
     if (!value) return;
+    if (__builtin_expect(simulator_ != NULL, 0)) {
+      simulator_->Write(GPIOSimulator::CLEAR_BITS, value, slowdown_ + 1);
+      return;
+    }
     *gpio_clr_bits_ = value;
     for (int i = 0; i < slowdown_; ++i) {
       *gpio_clr_bits_ = value;
@@ -79,6 +174,7 @@ class GPIO {
   volatile uint32_t *gpio_port_;
   volatile uint32_t *gpio_set_bits_;
   volatile uint32_t *gpio_clr_bits_;
+  GPIOSimulator *simulator_;
 };
 
 // A PinPulser is a utility class that pulses a GPIO pin. There can be various
@@ -102,6 +198,22 @@ public:
 
   // If SendPulse() is asynchronously implemented, wait for pulse to finish.
   virtual void WaitPulseFinished() {}
+
+  // Statistics. Only to be read from the thread sending the pulses.
+
+  // Nanoseconds spent waiting for pulses to finish.
+  uint64_t wait_nanos() const { return wait_nanos_; }
+
+  // Number of pulses whose timing was missed because the thread woke up
+  // too late from sleeping: synchronous pulses lasted longer than they
+  // should, asynchronous ones left the LEDs dark until the next one.
+  uint64_t overruns() const { return overruns_; }
+
+protected:
+  PinPulser() : wait_nanos_(0), overruns_(0) {}
+
+  uint64_t wait_nanos_;
+  uint64_t overruns_;
 };
 
 }  // end namespace rgb_matrix
@@ -9,8 +9,9 @@
 
 #include "canvas.h"
 
-#include <map>
+#include <stddef.h>
 #include <stdint.h>
+#include <vector>
 
 namespace rgb_matrix {
 struct Color {
@@ -40,6 +41,11 @@ public:
   // does not exist.
   int CharacterWidth(uint32_t unicode_codepoint) const;
 
+  // Return how many pixels DrawGlyph() advances for the given character.
+  // This is the device width of the glyph or of the replacement character
+  // if we don't have it, 0 if neither exists.
+  int CharacterAdvance(uint32_t unicode_codepoint) const;
+
   // Draws the unicode character at position "x","y"
   // with "color" on "background_color" (background_color can be NULL for
   // transparency.
@@ -67,14 +73,35 @@ public:
 private:
   Font(const Font& x);  // No copy constructor. Use references or pointer instead.
 
-  struct Glyph;
-  typedef std::map<uint32_t, Glyph*> CodepointGlyphMap;
+  // Glyphs are kept in one vector sorted by codepoint, their bitmaps in one
+  // contiguous arena, so drawing text touches few cache lines and loading
+  // fonts doesn't leave lots of little allocations behind.
+  struct Glyph {
+    uint32_t codepoint;
+    int device_width, device_height;
+    int width, height;
+    int x_offset, y_offset;
+    size_t bitmap_offset;  // Index of the first of 'height' rows in bitmaps_
+  };
 
   const Glyph *FindGlyph(uint32_t codepoint) const;
+  const uint32_t *Bitmap(const Glyph *g) const {
+    return &bitmaps_[g->bitmap_offset];
+  }
+  void IndexGlyphs();
+  int LookupAdvance(uint32_t codepoint) const;
+  void UpdateAdvanceCache();
 
   int font_height_;
   int base_line_;
-  CodepointGlyphMap glyphs_;
+  std::vector<Glyph> glyphs_;     // Sorted by codepoint.
+  std::vector<uint32_t> bitmaps_; // Rows of all glyphs, MSB is leftmost.
+  // Index into glyphs_ of the first 256 code points, -1 if not in the font.
+  // Anything else is found with a binary search.
+  int latin1_glyphs_[256];
+  // Advances of the first 256 code points, which make up most text, so
+  // measuring doesn't need a glyph lookup per character.
+  int advance_cache_[256];
 };
 
 // -- Some utility functions.
@@ -94,6 +121,11 @@ int DrawText(Canvas *c, const Font &font, int x, int y,
 int DrawText(Canvas *c, const Font &font, int x, int y, const Color &color,
              const char *utf8_text);
 
+// Return how many pixels DrawText() would advance for "utf8_text" with
+// the given "font" and "kerning_offset", without drawing anything.
+int MeasureText(const Font &font, const char *utf8_text,
+                int kerning_offset = 0);
+
 // Draw text, a standard NUL terminated C-string encoded in UTF-8,
 // with given "font" at "x","y" with "color".
 // Draw text as above, but vertically (top down).
@@ -90,7 +90,7 @@ struct RGBLedMatrixOptions {
    */
   int brightness;
 
-  /* Scan mode: 0=progressive, 1=interlaced
+  /* Scan mode: 0=progressive, 1=interlaced, 2=split pulses
    * Corresponding flag: --led-scan-mode
    */
   int scan_mode;
@@ -37,6 +37,28 @@ class Framebuffer;
 class PixelMapper;
 }
 
+// Statistics of the refresh thread, see RGBMatrix::GetRefreshStats(). All
+// counts are since the refresh started; take differences for a period.
+struct RefreshStats {
+  enum { kHistogramBuckets = 16 };
+
+  uint64_t refreshes;            // Complete refreshes of all rows.
+  uint64_t refresh_nanos;        // Time they took together.
+
+  // Refreshes by duration: bucket i counts the ones that took from 2^i up
+  // to 2^(i+1) microseconds; the first also has shorter, the last longer.
+  uint64_t refresh_histogram[kHistogramBuckets];
+
+  // Time the refresh thread spent waiting for output enable pulses to
+  // finish, and pulses whose timing it missed (see PinPulser::overruns()).
+  // With the simulated GPIO backend, waiting is in simulated time.
+  uint64_t pulse_wait_nanos;
+  uint64_t pulse_overruns;
+
+  uint64_t swaps;                // Frames the refresh switched to.
+  uint64_t missed_swaps;         // Submitted frames replaced before shown.
+};
+
 // The RGB matrix provides the framebuffer and the facilities to constantly
 // update the LED matrix.
 //
@@ -99,7 +121,9 @@ public:
     // Flag: --led-brightness
     int brightness;
 
-    // Scan mode: 0=progressive, 1=interlaced
+    // Scan mode: 0=progressive, 1=interlaced, 2=split pulses: the long
+    // pulses of the brightest bitplanes are split and interleaved with the
+    // other rows. Higher visual refresh rate, but switches rows more often.
     // Flag: --led-scan-mode
     int scan_mode;
 
@@ -112,6 +136,12 @@ public:
     // Flag: --led-hardware-pulse
     bool disable_hardware_pulsing;
     bool show_refresh_rate;    // Flag: --led-show-refresh
+
+    // If set, the refresh statistics (see GetRefreshStats()) are written to
+    // this file every few seconds. Default: NULL
+    // Flag: --led-refresh-stats
+    const char *refresh_stats_file;
+
     // bool swap_green_blue; (Deprecated: use led_sequence instead)
     bool inverse_colors;       // Flag: --led-inverse
 
@@ -224,6 +254,33 @@ public:
   // 28Hz animation, nicely locked to the frame-rate).
   FrameCanvas *SwapOnVSync(FrameCanvas *other, unsigned framerate_fraction = 1);
 
+  // Non-blocking alternative to SwapOnVSync() to pipeline drawing the next
+  // frame with showing this one: "frame" is shown from the next vsync on
+  // (see "framerate_fraction" above), but this returns right away with a
+  // ticket for FramePending(). A frame submitted before but not shown yet is
+  // replaced; only the latest submitted frame is shown.
+  //
+  // Don't draw on "frame" anymore, get the next one with TakeFreeFrame().
+  uint32_t SubmitFrame(FrameCanvas *frame, unsigned framerate_fraction = 1);
+
+  // Returns 'true' while the frame submitted with "ticket" still waits to
+  // be shown.
+  bool FramePending(uint32_t ticket) const;
+
+  // Returns a FrameCanvas that is neither shown nor waiting to be shown, to
+  // draw the next frame on, or NULL if there is none right now.
+  // A replaced frame is free right away, the one shown before a submitted
+  // frame once the refresh switched to that. With three FrameCanvases
+  // (the initially active one included), there is always one to draw on
+  // while one is shown and one is waiting.
+  FrameCanvas *TakeFreeFrame();
+
+  // An eventfd(2) that becomes readable whenever the refresh has switched to
+  // a submitted frame, freeing the frame shown before; use with poll() or
+  // select() and read() the 8 byte counter to reset it. It exists as long as
+  // the refresh thread, so it can be fetched once after StartRefresh().
+  int frame_done_fd() const;
+
   // Set image transformer that maps the logical canvas coordinates to the
   // physical canvas coordinates.
   // This preprocesses the transformation for static pixel mapping once.
@@ -233,6 +290,24 @@ public:
   //  manually use them to wrap canvases.)
   void ApplyStaticTransformer(const CanvasTransformer &transformer);
 
+  // Fills "stats" with the statistics of the refresh thread. Cheap and never
+  // holds up the refresh; can be called from any thread.
+  void GetRefreshStats(RefreshStats *stats) const;
+
+  // The GPIO simulator if the matrix runs with the simulated GPIO backend
+  // (RuntimeOptions::gpio_backend "sim"), otherwise NULL. Its simulated time
+  // between two SwapOnVSync() gives the modeled duration of a refresh.
+  const GPIOSimulator *gpio_simulator() const;
+
+  // With the simulated GPIO backend, reconstructs what the panels currently
+  // show from the recorded GPIO writes, as packed 24bpp RGB in the physical
+  // panel layout: (32 * chain_length) x (rows * parallel) pixels, before
+  // any transformers. Each channel is the LED on-time in steps of an 8 bit
+  // color value; inverse colors are not undone.
+  // Returns false without the simulator or if not every row has been
+  // refreshed since enough events are recorded.
+  bool DecodeSimulatedFrame(std::vector<uint8_t> *rgb) const;
+
   // Don't use this function anymore, use ApplyStaticTransformer() instead.
   // See demo-main.cc how.
   //
@@ -263,10 +338,18 @@ public:
                         uint8_t red, uint8_t green, uint8_t blue);
   virtual void Clear();
   virtual void Fill(uint8_t red, uint8_t green, uint8_t blue);
+  virtual void SetBitmap(int x, int y, int width, int height,
+                         const uint32_t *rows,
+                         uint8_t red, uint8_t green, uint8_t blue);
+  virtual void SetPixels(int x, int y, int width, int height,
+                         const uint8_t *rgb, int stride);
+  virtual void FillRect(int x, int y, int width, int height,
+                        uint8_t red, uint8_t green, uint8_t blue);
 
 private:
   class UpdateThread;
   friend class UpdateThread;
+  class StatsDumper;
 
   Options params_;
   bool do_luminance_correct_;
@@ -277,6 +360,7 @@ private:
   Mutex active_frame_sync_;
   CanvasTransformer *transformer_;  // deprecated. To be removed.
   UpdateThread *updater_;
+  StatsDumper *stats_dumper_;
   std::vector<FrameCanvas*> created_frames_;
   internal::PixelMapper *shared_pixel_mapper_;
 };
@@ -318,6 +402,20 @@ public:
   // This method should only be called if FrameCanvas is off-screen.
   bool Deserialize(const char *data, size_t len);
 
+  // Make this canvas a copy of "other", which needs to come from the same
+  // RGBMatrix. Much cheaper than going through Serialize()/Deserialize():
+  // only the parts written to since the previous copy between the two are
+  // looked at, and only the parts that differ count as changed.
+  // Returns 'false' if the sizes don't match.
+  // This method should only be called if FrameCanvas is off-screen.
+  bool CopyFrom(const FrameCanvas &other);
+
+  // Replace the whole canvas with packed 24bpp RGB data, width() x height()
+  // pixels, each row starting "stride" bytes after the previous one.
+  // Same as SetPixels() for the full canvas: one call per frame of a video
+  // or image instead of one virtual SetPixel() call per pixel.
+  void LoadRGB(const uint8_t *rgb, int stride);
+
   // -- Canvas interface.
   virtual int width() const;
   virtual int height() const;
@@ -325,13 +423,21 @@ public:
                         uint8_t red, uint8_t green, uint8_t blue);
   virtual void Clear();
   virtual void Fill(uint8_t red, uint8_t green, uint8_t blue);
+  virtual void SetBitmap(int x, int y, int width, int height,
+                         const uint32_t *rows,
+                         uint8_t red, uint8_t green, uint8_t blue);
+  virtual void SetPixels(int x, int y, int width, int height,
+                         const uint8_t *rgb, int stride);
+  virtual void FillRect(int x, int y, int width, int height,
+                        uint8_t red, uint8_t green, uint8_t blue);
 
 private:
   friend class RGBMatrix;
+  friend class StreamWriter;
 
   FrameCanvas(internal::Framebuffer *frame) : frame_(frame){}
   virtual ~FrameCanvas();   // Any FrameCanvas is owned by RGBMatrix.
-  internal::Framebuffer *framebuffer() { return frame_; }
+  internal::Framebuffer *framebuffer() const { return frame_; }
 
   internal::Framebuffer *const frame_;
 };
@@ -356,6 +462,11 @@ struct RuntimeOptions {
   // do that yourself, set this flag to false.
   // Then, you have to initialize the matrix yourself with SetGPIO().
   bool do_gpio_init;
+
+  // Where the output goes: "rpi" are the GPIO registers of the Raspberry Pi
+  // (needs root), "sim" a GPIOSimulator, which runs the refresh on any host
+  // without hardware, e.g. to profile or test it.
+  const char *gpio_backend;  // Flag: --led-gpio-backend
 };
 
 // Convenience utility functions to read standard rgb-matrix flags and create
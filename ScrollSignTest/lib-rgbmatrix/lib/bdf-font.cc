@@ -19,6 +19,8 @@
 #include <stdio.h>
 #include <string.h>
 
+#include <algorithm>
+
 // The little question-mark box "�" for unknown code.
 static const uint32_t kUnicodeReplacementCodepoint = 0xFFFD;
 
@@ -27,19 +29,21 @@ static const uint32_t kUnicodeReplacementCodepoint = 0xFFFD;
 typedef uint32_t rowbitmap_t;
 
 namespace rgb_matrix {
-struct Font::Glyph {
-  int device_width, device_height;
-  int width, height;
-  int x_offset,y_offset;
-  rowbitmap_t bitmap[0];  // contains 'height' elements.
+namespace {
+struct CodepointLess {
+  template <typename G>
+  bool operator()(const G &a, const G &b) const {
+    return a.codepoint < b.codepoint;
+  }
+  template <typename G>
+  bool operator()(const G &a, uint32_t cp) const { return a.codepoint < cp; }
 };
+}  // namespace
 
-Font::Font() : font_height_(-1), base_line_(0) {}
+Font::Font() : font_height_(-1), base_line_(0) {
+  IndexGlyphs();
+}
 Font::~Font() {
-  for (CodepointGlyphMap::iterator it = glyphs_.begin();
-       it != glyphs_.end(); ++it) {
-    free(it->second);
-  }
 }
 
 // TODO: that might not be working for all input files yet.
@@ -52,7 +56,7 @@ bool Font::LoadFont(const char *path) {
   char buffer[1024];
   int dummy;
   Glyph tmp;
-  Glyph *current_glyph = NULL;
+  bool in_glyph = false;
   int row = 0;
 
   int bitmap_shift = 0;
@@ -70,33 +74,36 @@ bool Font::LoadFont(const char *path) {
     }
     else if (sscanf(buffer, "BBX %d %d %d %d", &tmp.width, &tmp.height,
                     &tmp.x_offset, &tmp.y_offset) == 4) {
-      current_glyph = (Glyph*) malloc(sizeof(Glyph)
-                                      + tmp.height * sizeof(rowbitmap_t));
-      *current_glyph = tmp;
+      if (in_glyph) bitmaps_.resize(tmp.bitmap_offset);  // Incomplete one.
+      tmp.bitmap_offset = bitmaps_.size();
+      bitmaps_.resize(bitmaps_.size() + tmp.height);
+      in_glyph = true;
       // We only get number of bytes large enough holding our width. We want
       // it always left-aligned.
       bitmap_shift =
-        8 * (sizeof(rowbitmap_t) - ((current_glyph->width + 7) / 8)) -
-              current_glyph->x_offset;
+        8 * (sizeof(rowbitmap_t) - ((tmp.width + 7) / 8)) - tmp.x_offset;
       row = -1;  // let's not start yet, wait for BITMAP
     }
     else if (strncmp(buffer, "BITMAP", strlen("BITMAP")) == 0) {
       row = 0;
     }
-    else if (current_glyph && row >= 0 && row < current_glyph->height
-             && (sscanf(buffer, "%x", &current_glyph->bitmap[row]) == 1)) {
-      current_glyph->bitmap[row] <<= bitmap_shift;
+    else if (in_glyph && row >= 0 && row < tmp.height
+             && (sscanf(buffer, "%x",
+                        &bitmaps_[tmp.bitmap_offset + row]) == 1)) {
+      bitmaps_[tmp.bitmap_offset + row] <<= bitmap_shift;
       row++;
     }
     else if (strncmp(buffer, "ENDCHAR", strlen("ENDCHAR")) == 0) {
-      if (current_glyph && row == current_glyph->height) {
-        free(glyphs_[codepoint]);  // just in case there was one.
-        glyphs_[codepoint] = current_glyph;
-        current_glyph = NULL;
+      if (in_glyph && row == tmp.height) {
+        tmp.codepoint = codepoint;
+        glyphs_.push_back(tmp);
+        in_glyph = false;
       }
     }
   }
+  if (in_glyph) bitmaps_.resize(tmp.bitmap_offset);
   fclose(f);
+  IndexGlyphs();
   return true;
 }
 
@@ -105,47 +112,81 @@ Font *Font::CreateOutlineFont() const {
   const int kBorder = 1;
   r->font_height_ = font_height_ + 2*kBorder;
   r->base_line_ = base_line_ + kBorder;
-  for (CodepointGlyphMap::const_iterator it = glyphs_.begin();
-       it != glyphs_.end(); ++it) {
-    const Glyph *orig = it->second;
+  r->glyphs_.reserve(glyphs_.size());
+  r->bitmaps_.reserve(bitmaps_.size() + glyphs_.size() * 2 * kBorder);
+  for (size_t i = 0; i < glyphs_.size(); ++i) {
+    const Glyph *orig = &glyphs_[i];
+    const rowbitmap_t *orig_rows = Bitmap(orig);
     const int height = orig->height + 2 * kBorder;
-    const size_t alloc_size = sizeof(Glyph) + height * sizeof(rowbitmap_t);
-    Glyph *const tmp_glyph = (Glyph*) calloc(1, alloc_size);
-    tmp_glyph->width  = orig->width  + 2*kBorder;
-    tmp_glyph->height = height;
-    tmp_glyph->device_width  = orig->device_width;
-    tmp_glyph->device_height = height;
-    tmp_glyph->y_offset = orig->y_offset - kBorder;
+    Glyph tmp_glyph;
+    tmp_glyph.codepoint = orig->codepoint;
+    tmp_glyph.width  = orig->width  + 2*kBorder;
+    tmp_glyph.height = height;
+    tmp_glyph.device_width  = orig->device_width;
+    tmp_glyph.device_height = height;
+    tmp_glyph.x_offset = 0;
+    tmp_glyph.y_offset = orig->y_offset - kBorder;
+    tmp_glyph.bitmap_offset = r->bitmaps_.size();
+    r->bitmaps_.resize(r->bitmaps_.size() + height, 0);
+    rowbitmap_t *const bitmap = &r->bitmaps_[tmp_glyph.bitmap_offset];
     // TODO: we don't really need bounding box, right ?
     const rowbitmap_t fill_pattern = 0b111;
     const rowbitmap_t start_mask   = 0b010;
     // Fill the border
     for (int h = 0; h < orig->height; ++h) {
       rowbitmap_t fill = fill_pattern;
-      rowbitmap_t orig_bitmap = orig->bitmap[h] >> kBorder;
+      rowbitmap_t orig_bitmap = orig_rows[h] >> kBorder;
       for (rowbitmap_t m = start_mask; m; m <<= 1, fill <<= 1) {
         if (orig_bitmap & m) {
-          tmp_glyph->bitmap[h+kBorder-1] |= fill;
-          tmp_glyph->bitmap[h+kBorder+0] |= fill;
-          tmp_glyph->bitmap[h+kBorder+1] |= fill;
+          bitmap[h+kBorder-1] |= fill;
+          bitmap[h+kBorder+0] |= fill;
+          bitmap[h+kBorder+1] |= fill;
         }
       }
     }
     // Remove original font again.
     for (int h = 0; h < orig->height; ++h) {
-      rowbitmap_t orig_bitmap = orig->bitmap[h] >> kBorder;
-      tmp_glyph->bitmap[h+kBorder] &= ~orig_bitmap;
+      rowbitmap_t orig_bitmap = orig_rows[h] >> kBorder;
+      bitmap[h+kBorder] &= ~orig_bitmap;
     }
-    r->glyphs_[it->first] = tmp_glyph;
+    r->glyphs_.push_back(tmp_glyph);
   }
+  r->IndexGlyphs();
   return r;
 }
 
+// Brings glyphs_ into codepoint order, the last definition of a codepoint
+// winning, and rebuilds the lookup tables.
+void Font::IndexGlyphs() {
+  std::stable_sort(glyphs_.begin(), glyphs_.end(), CodepointLess());
+  std::vector<Glyph> unique;
+  unique.reserve(glyphs_.size());
+  for (size_t i = 0; i < glyphs_.size(); ++i) {
+    if (!unique.empty() && unique.back().codepoint == glyphs_[i].codepoint)
+      unique.back() = glyphs_[i];
+    else
+      unique.push_back(glyphs_[i]);
+  }
+  glyphs_.swap(unique);
+
+  for (int cp = 0; cp < 256; ++cp) latin1_glyphs_[cp] = -1;
+  for (size_t i = 0; i < glyphs_.size() && glyphs_[i].codepoint < 256; ++i) {
+    latin1_glyphs_[glyphs_[i].codepoint] = i;
+  }
+  UpdateAdvanceCache();
+}
+
 const Font::Glyph *Font::FindGlyph(uint32_t unicode_codepoint) const {
-  CodepointGlyphMap::const_iterator found = glyphs_.find(unicode_codepoint);
-  if (found == glyphs_.end())
+  if (unicode_codepoint < 256) {
+    const int index = latin1_glyphs_[unicode_codepoint];
+    return index < 0 ? NULL : &glyphs_[index];
+  }
+  std::vector<Glyph>::const_iterator found =
+    std::lower_bound(glyphs_.begin(), glyphs_.end(), unicode_codepoint,
+                     CodepointLess());
+  if (found == glyphs_.end() || found->codepoint != unicode_codepoint)
     return NULL;
-  return found->second;
+  return &*found;
 }
 
 int Font::CharacterWidth(uint32_t unicode_codepoint) const {
@@ -153,6 +194,23 @@ int Font::CharacterWidth(uint32_t unicode_codepoint) const {
   return g ? g->width : -1;
 }
 
+int Font::LookupAdvance(uint32_t unicode_codepoint) const {
+  const Glyph *g = FindGlyph(unicode_codepoint);
+  if (g == NULL) g = FindGlyph(kUnicodeReplacementCodepoint);
+  return g ? g->device_width : 0;
+}
+
+void Font::UpdateAdvanceCache() {
+  for (uint32_t cp = 0; cp < 256; ++cp) {
+    advance_cache_[cp] = LookupAdvance(cp);
+  }
+}
+
+int Font::CharacterAdvance(uint32_t unicode_codepoint) const {
+  if (unicode_codepoint < 256) return advance_cache_[unicode_codepoint];
+  return LookupAdvance(unicode_codepoint);
+}
+
 int Font::DrawGlyph(Canvas *c, int x_pos, int y_pos,
                     const Color &color, const Color *bgcolor,
                     uint32_t unicode_codepoint) const {
@@ -160,17 +218,16 @@ int Font::DrawGlyph(Canvas *c, int x_pos, int y_pos,
   if (g == NULL) g = FindGlyph(kUnicodeReplacementCodepoint);
   if (g == NULL) return 0;
   y_pos = y_pos - g->height - g->y_offset;
-  for (int y = 0; y < g->height; ++y) {
-    const rowbitmap_t row = g->bitmap[y];
-    rowbitmap_t x_mask = 0x80000000;
-    for (int x = 0; x < g->device_width; ++x, x_mask >>= 1) {
-      if (row & x_mask) {
-        c->SetPixel(x_pos + x, y_pos + y, color.r, color.g, color.b);
-      } else if (bgcolor) {
-          c->SetPixel(x_pos + x, y_pos + y, bgcolor->r, bgcolor->g, bgcolor->b);
-      }
+  const rowbitmap_t *const bitmap = Bitmap(g);
+  if (bgcolor) {
+    for (int y = 0; y < g->height; ++y) {
+      const rowbitmap_t background = ~bitmap[y];
+      c->SetBitmap(x_pos, y_pos + y, g->device_width, 1, &background,
+                   bgcolor->r, bgcolor->g, bgcolor->b);
     }
   }
+  c->SetBitmap(x_pos, y_pos, g->device_width, g->height, bitmap,
+               color.r, color.g, color.b);
   return g->device_width;
 }
 
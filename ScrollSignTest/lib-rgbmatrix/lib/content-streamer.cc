@@ -1,6 +1,7 @@
 // -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
 
 #include "content-streamer.h"
+#include "framebuffer-internal.h"
 #include "led-matrix.h"
 
 #include <fcntl.h>
@@ -25,17 +26,20 @@ struct FileHeader {
   uint32_t buf_size;
   uint32_t width;
   uint32_t height;
-  uint64_t future_use1;
+  uint64_t rows;  // Rows of partial frames, buf_size / rows bytes each.
   uint64_t future_use2;
 };
 
 static const uint32_t kFrameMagicValue = 0x12345678;
+// A partial frame only contains the rows that changed from the previous
+// frame, in order.
+static const uint32_t kPartialFrameFlag = 0x01;
 struct FrameHeader {
   uint32_t magic;  // kFrameMagic
   uint32_t size;
   uint32_t hold_time_us;  // How long this frame lasts in usec.
-  uint32_t future_use1;
-  uint64_t future_use2;
+  uint32_t flags;
+  uint64_t changed_rows;  // Bitmap of the rows in a partial frame.
   uint64_t future_use3;
 };
 }
@@ -88,7 +92,8 @@ static ssize_t FullAppend(StreamIO *io, const void *buf, const size_t count) {
   return count;
 }
 
-StreamWriter::StreamWriter(StreamIO *io) : io_(io), header_written_(false) {}
+StreamWriter::StreamWriter(StreamIO *io)
+  : io_(io), header_written_(false), last_serial_(0) {}
 bool StreamWriter::Stream(const FrameCanvas &frame, uint32_t hold_time_us) {
   const char *data;
   size_t len;
@@ -97,12 +102,43 @@ bool StreamWriter::Stream(const FrameCanvas &frame, uint32_t hold_time_us) {
   if (!header_written_) {
     WriteFileHeader(frame, len);
   }
+
+  // Rows not written to since the last time this canvas was streamed are
+  // left out. Generations are read before the data, so a concurrent
+  // change is streamed again with the next frame.
+  const internal::Framebuffer *fb = frame.framebuffer();
+  const int rows = fb->double_rows();
+  const size_t row_size = fb->row_size();
+  const bool same_frame = (fb->serial() == last_serial_);
+  last_serial_ = fb->serial();
+  last_generations_.resize(rows);
+  uint64_t changed_rows = 0;
+  for (int row = 0; row < rows; ++row) {
+    const uint32_t generation = fb->row_generation(row);
+    if (!same_frame || generation != last_generations_[row]) {
+      changed_rows |= 1ULL << row;
+    }
+    last_generations_[row] = generation;
+  }
+  const bool partial = same_frame
+    && changed_rows != ((rows == 64) ? ~0ULL : (1ULL << rows) - 1);
+
   FrameHeader h = {};
   h.magic = kFrameMagicValue;
-  h.size = len;
+  h.size = partial ? __builtin_popcountll(changed_rows) * row_size : len;
   h.hold_time_us = hold_time_us;
+  h.flags = partial ? kPartialFrameFlag : 0;
+  h.changed_rows = partial ? changed_rows : 0;
   FullAppend(io_, &h, sizeof(h));
-  return FullAppend(io_, data, len) == (ssize_t)len;
+  if (!partial) {
+    return FullAppend(io_, data, len) == (ssize_t)len;
+  }
+  for (int row = 0; row < rows; ++row) {
+    if ((changed_rows & (1ULL << row)) == 0) continue;
+    if (FullAppend(io_, data + row * row_size, row_size) != (ssize_t)row_size)
+      return false;
+  }
+  return true;
 }
 
 void StreamWriter::WriteFileHeader(const FrameCanvas &frame, size_t len) {
@@ -111,12 +147,13 @@ void StreamWriter::WriteFileHeader(const FrameCanvas &frame, size_t len) {
   header.width = frame.width();
   header.height = frame.height();
   header.buf_size = len;
+  header.rows = frame.framebuffer()->double_rows();
   FullAppend(io_, &header, sizeof(header));
   header_written_ = true;
 }
 
 StreamReader::StreamReader(StreamIO *io)
-  : io_(io), state_(STREAM_AT_BEGIN), buffer_(NULL) {
+  : io_(io), row_size_(0), state_(STREAM_AT_BEGIN), buffer_(NULL) {
   io_->Rewind();
 }
 StreamReader::~StreamReader() { delete [] buffer_; }
@@ -139,6 +176,22 @@ bool StreamReader::GetNext(FrameCanvas *frame, uint32_t* hold_time_us) {
     state_ = STREAM_ERROR;
     return false;
   }
+  if (h.flags & kPartialFrameFlag) {
+    // Update the changed rows of the previous frame still in buffer_.
+    if (row_size_ == 0
+        || h.size != __builtin_popcountll(h.changed_rows) * row_size_) {
+      state_ = STREAM_ERROR;
+      return false;
+    }
+    if (hold_time_us) *hold_time_us = h.hold_time_us;
+    for (size_t row = 0; row * row_size_ < buf_size_; ++row) {
+      if ((h.changed_rows & (1ULL << row)) == 0) continue;
+      if (FullRead(io_, buffer_ + row * row_size_, row_size_)
+          != (ssize_t)row_size_)
+        return false;
+    }
+    return frame->Deserialize(buffer_, buf_size_);
+  }
   // In the future, we might allow larger buffers (audio?), but never smaller.
   if (h.size < buf_size_)
     return false;
@@ -162,6 +215,9 @@ bool StreamReader::ReadFileHeader(const FrameCanvas &frame) {
   }
   state_ = STREAM_READING;
   buf_size_ = header.buf_size;
+  // Streams written before partial frames existed don't have any.
+  row_size_ = (header.rows > 0 && header.rows <= 64)
+    ? header.buf_size / header.rows : 0;
   if (!buffer_) buffer_ = new char [ header.buf_size ];
   return true;
 }
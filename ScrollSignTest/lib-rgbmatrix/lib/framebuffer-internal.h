@@ -18,10 +18,13 @@
 #include <stdint.h>
 #include <stdlib.h>
 
+#include <vector>
+
 #include "hardware-mapping.h"
 
 namespace rgb_matrix {
 class GPIO;
+class GPIOSimulator;
 class PinPulser;
 namespace internal {
 
@@ -72,6 +75,9 @@ public:
                        bool allow_hardware_pulsing,
                        int pwm_lsb_nanoseconds);
 
+  // The output enable pulser set up by InitGPIO(), for its statistics.
+  static const PinPulser *output_enable_pulser();
+
   // Set PWM bits used for output. Default is 11, but if you only deal with
   // simple comic-colors, 1 might be sufficient. Lower require less CPU.
   // Returns boolean to signify if value was within range.
@@ -79,26 +85,64 @@ public:
   uint8_t pwmbits() { return pwm_bits_; }
 
   // Map brightness of output linearly to input with CIE1931 profile.
-  void set_luminance_correct(bool on) { do_luminance_correct_ = on; }
+  void set_luminance_correct(bool on) {
+    do_luminance_correct_ = on;
+    color_lookup_valid_ = false;
+  }
   bool luminance_correct() const { return do_luminance_correct_; }
 
   // Set brightness in percent; range=1..100
   // This will only affect newly set pixels.
   void SetBrightness(uint8_t b) {
     brightness_ = (b <= 100 ? (b != 0 ? b : 1) : 100);
+    color_lookup_valid_ = false;
   }
   uint8_t brightness() { return brightness_; }
 
   void DumpToMatrix(GPIO *io);
 
+  // Reconstructs what the panels show from the writes recorded by
+  // "simulator" into packed 24bpp RGB of columns x (rows * parallel)
+  // pixels in panel layout. Each channel is the on-time of the LED in steps
+  // of an 8 bit color value. Returns false if the recorded events don't hold
+  // a complete refresh yet.
+  bool DecodeSimulatedOutput(const GPIOSimulator &simulator,
+                             std::vector<uint8_t> *rgb);
+
   void Serialize(const char **data, size_t *len) const;
   bool Deserialize(const char *data, size_t len);
 
+  // Make this a copy of "other", which needs to have the same size. Only
+  // double rows written to since the last copy between the two are copied.
+  // Returns false if the size doesn't match.
+  bool CopyFrom(const Framebuffer &other);
+
+  // The serialized data is one block of row_size() bytes per double row, the
+  // rows multiplexed together. The row_generation() of a double row changes
+  // with every write to it; generations are only comparable for the same
+  // serial(), which is unique for each Framebuffer.
+  int double_rows() const { return double_rows_; }
+  size_t row_size() const { return buffer_size_ / double_rows_; }
+  uint32_t row_generation(int double_row) const {
+    return __atomic_load_n(&row_generation_[double_row], __ATOMIC_ACQUIRE);
+  }
+  uint32_t serial() const { return serial_; }
+
   // Canvas-inspired methods, but we're not implementing this interface to not
   // have an unnecessary vtable.
   int width() const;
   int height() const;
   void SetPixel(int x, int y, uint8_t red, uint8_t green, uint8_t blue);
+  void SetBitmap(int x, int y, int width, int height, const uint32_t *rows,
+                 uint8_t red, uint8_t green, uint8_t blue);
+  void SetPixels(int x, int y, int width, int height,
+                 const uint8_t *rgb, int stride);
+  // Replace the whole frame with packed 24bpp RGB data.
+  void LoadRGB(const uint8_t *rgb, int stride) {
+    SetPixels(0, 0, width(), height(), rgb, stride);
+  }
+  void FillRect(int x, int y, int width, int height,
+                uint8_t red, uint8_t green, uint8_t blue);
   void Clear();
   void Fill(uint8_t red, uint8_t green, uint8_t blue);
 
@@ -115,6 +159,10 @@ private:
   void InitDefaultDesignator(int x, int y, PixelDesignator *designator);
   inline void  MapColors(uint8_t r, uint8_t g, uint8_t b,
                          uint16_t *red, uint16_t *green, uint16_t *blue);
+  void UpdateColorLookup();
+  inline void WritePixel(const PixelDesignator &designator,
+                         uint16_t red, uint16_t green, uint16_t blue,
+                         int32_t *lit_delta);
   const int rows_;     // Number of rows. 16 or 32.
   const int parallel_; // Parallel rows of chains. 1 or 2.
   const int height_;   // rows * parallel
@@ -128,6 +176,12 @@ private:
   bool do_luminance_correct_;
   uint8_t brightness_;
 
+  // Bitplane bits for each 8 bit channel value with brightness, luminance
+  // correction and inverse colors applied, restricted to the shown planes.
+  // Rebuilt on next use whenever one of these settings changes.
+  bool color_lookup_valid_;
+  uint16_t color_lookup_[256];
+
   const int double_rows_;
   const uint8_t row_mask_;
   const size_t buffer_size_;
@@ -141,6 +195,83 @@ private:
   gpio_bits_t *bitplane_buffer_;
   inline gpio_bits_t *ValueAt(int double_row, int column, int bit);
 
+  // The refresh doesn't clock out the bitplanes directly, but a stream of
+  // GPIO writes compiled from those double rows that have changed: per
+  // double row, bitplane and column the bits to clear and the bits to set,
+  // relative to the previous column's output. Columns with the same data as
+  // their left neighbor then only need to toggle the clock.
+  void CompileOutputStreamRow(int double_row, int pwm_bits);
+  inline gpio_bits_t *StreamAt(int double_row, int bit);
+
+  gpio_bits_t *output_stream_;
+  uint32_t *output_stream_generation_;  // Row generations compiled.
+  int output_stream_pwm_bits_;   // Bitplanes the stream was compiled for.
+
+  // Also compiled per double row: the bitplanes that differ from the plane
+  // before. A plane the same as the one still latched is just pulsed again
+  // without clocking it in.
+  uint16_t clock_planes_[64];
+
+  // Number of pixels with any color on in each bitplane, kept up to date
+  // by all writes. The refresh leaves out the empty planes at the bottom of
+  // the shown ones: clocking them in takes as long as for any plane, while
+  // the pulses of the lowest planes are a tiny part of the refresh. Empty
+  // planes above a lit one are still pulsed; leaving out their long pulses
+  // would change the refresh period, and with it the brightness, with the
+  // content. Only the writing thread changes the counts; single stores, so
+  // the refresh can read them meanwhile.
+  uint32_t lit_pixels_[16];
+  // Writes sum up the change of each plane, then add it in one go.
+  void AddLitPixels(const int32_t *delta);
+  inline void SetLitPixels(int bit, uint32_t count) {
+    __atomic_store_n(&lit_pixels_[bit], count, __ATOMIC_RELAXED);
+  }
+  uint32_t lit_pixels(int bit) const {
+    return __atomic_load_n(&lit_pixels_[bit], __ATOMIC_RELAXED);
+  }
+  // Adds (sign 1) or removes (sign -1) the lit pixels of a double row.
+  void CountLitPixels(int double_row, int sign);
+
+  // Called after writing to the bitplanes of a double row. The release
+  // store pairs with the acquire in row_generation(): whoever sees the new
+  // generation also sees the new bits.
+  inline void MarkRowChanged(int double_row) {
+    __atomic_store_n(&row_generation_[double_row],
+                     row_generation_[double_row] + 1, __ATOMIC_RELEASE);
+  }
+  // Same for the double rows of the gpio words "first" to "last".
+  inline void MarkWordsChanged(int first, int last) {
+    for (int r = first / row_words_; r <= last / row_words_; ++r)
+      MarkRowChanged(r);
+  }
+
+  const uint32_t serial_;
+  const int row_words_;          // gpio words per double row.
+  uint32_t *row_generation_;     // Per double row.
+
+  // Rows at their cleared_generation_ still hold what the last Clear() or
+  // Fill() wrote, described by fill_key_; doing the same again skips them.
+  uint64_t fill_key_;
+  uint32_t *cleared_generation_;
+
+  // For CopyFrom(): the source copied last, and per double row its
+  // generation and ours right after that copy.
+  uint32_t copy_source_serial_;
+  uint32_t *copy_source_generation_;
+  uint32_t *copy_generation_;
+
+  // Constant per refresh, so figured out once.
+  gpio_bits_t color_clk_mask_;   // Bits while clocking in a column.
+  // (64 double rows with ONLY_SINGLE_SUB_PANEL and 64 rows.)
+  gpio_bits_t row_address_[64];  // GPIO address bits of each double row.
+  uint8_t scan_order_[64];       // Double rows in the order of the scan mode.
+  // Each refresh goes through all double rows passes_ times, showing the
+  // bitplanes of pass_planes_ in each. Planes above split_plane_ are shown
+  // as several pulses of its length.
+  int passes_;
+  uint16_t pass_planes_[8];
+  int split_plane_;
+
   PixelMapper **shared_mapper_;  // Storage in RGBMatrix.
 };
 }  // namespace internal
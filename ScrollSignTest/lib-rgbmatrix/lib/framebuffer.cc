@@ -21,12 +21,15 @@
 
 #include <assert.h>
 #include <ctype.h>
+#include <limits.h>
 #include <math.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include <algorithm>
+
 #include "gpio.h"
 
 namespace rgb_matrix {
@@ -35,6 +38,13 @@ enum {
   kBitPlanes = 11  // maximum usable bitplanes.
 };
 
+// Scan mode 2 shows the top kSplitBits + 1 planes as sub-pulses of the
+// length of the lowest of them, in 2^kSplitBits passes through the rows.
+enum {
+  kSplitBits = 3,
+  kSplitPasses = 1 << kSplitBits
+};
+
 // We need one global instance of a timing correct pulser. There are different
 // implementations depending on the context.
 static PinPulser *sOutputEnablePulser = NULL;
@@ -62,6 +72,16 @@ PixelMapper::~PixelMapper() {
 
 const struct HardwareMapping *Framebuffer::hardware_mapping_ = NULL;
 
+// Serials tell Framebuffers apart for CopyFrom() and the content streamer,
+// even if one is created at the address of a deleted one.
+static uint32_t NextSerial() {
+  static uint32_t last_serial = 0;
+  return __atomic_add_fetch(&last_serial, 1, __ATOMIC_RELAXED);
+}
+
+// fill_key_ of a memset() Clear(); Fill() keys never have the top bits set.
+static const uint64_t kClearedKey = ~0ULL;
+
 Framebuffer::Framebuffer(int rows, int columns, int parallel,
                          int scan_mode,
                          const char *led_sequence, bool inverse_color,
@@ -73,8 +93,12 @@ Framebuffer::Framebuffer(int rows, int columns, int parallel,
     scan_mode_(scan_mode),
     led_sequence_(led_sequence), inverse_color_(inverse_color),
     pwm_bits_(kBitPlanes), do_luminance_correct_(true), brightness_(100),
+    color_lookup_valid_(false),
     double_rows_(rows / SUB_PANELS_), row_mask_(double_rows_ - 1),
     buffer_size_(double_rows_ * columns_ * kBitPlanes * sizeof(gpio_bits_t)),
+    output_stream_pwm_bits_(0),
+    serial_(NextSerial()), row_words_(columns_ * kBitPlanes),
+    fill_key_(0), copy_source_serial_(0),
     shared_mapper_(mapper) {
   assert(hardware_mapping_ != NULL);   // Called InitHardwareMapping() ?
   assert(shared_mapper_ != NULL);  // Storage should be provided by RGBMatrix.
@@ -89,6 +113,73 @@ Framebuffer::Framebuffer(int rows, int columns, int parallel,
   assert(parallel >= 1 && parallel <= 3);
 
   bitplane_buffer_ = new gpio_bits_t[double_rows_ * columns_ * kBitPlanes];
+  output_stream_ = new gpio_bits_t[2 * double_rows_ * columns_ * kBitPlanes];
+  output_stream_generation_ = new uint32_t[double_rows_]();
+  row_generation_ = new uint32_t[double_rows_]();
+  // Nothing written yet, so the first Clear() can't skip anything.
+  cleared_generation_ = new uint32_t[double_rows_]();
+  for (int row = 0; row < double_rows_; ++row) cleared_generation_[row] = ~0u;
+  copy_source_generation_ = new uint32_t[double_rows_]();
+  copy_generation_ = new uint32_t[double_rows_]();
+
+  const struct HardwareMapping &h = *hardware_mapping_;
+  color_clk_mask_ = h.p0_r1 | h.p0_g1 | h.p0_b1 | h.p0_r2 | h.p0_g2 | h.p0_b2;
+  if (parallel_ >= 2) {
+    color_clk_mask_ |= h.p1_r1 | h.p1_g1 | h.p1_b1 | h.p1_r2 | h.p1_g2 | h.p1_b2;
+  }
+  if (parallel_ >= 3) {
+    color_clk_mask_ |= h.p2_r1 | h.p2_g1 | h.p2_b1 | h.p2_r2 | h.p2_g2 | h.p2_b2;
+  }
+  color_clk_mask_ |= h.clock;
+
+  // info needed for interlace mode.
+  uint8_t rot_bits = 0;
+  switch (double_rows_) {
+  case  4: rot_bits = 1; break;
+  case  8: rot_bits = 2; break;
+  case 16: rot_bits = 3; break;
+  case 32: rot_bits = 4; break;
+  }
+  for (int row_loop = 0; row_loop < double_rows_; ++row_loop) {
+    switch (scan_mode_) {
+    case 0:  // progressive
+    default:
+      scan_order_[row_loop] = row_loop;
+      break;
+
+    case 1:  // interlaced
+      scan_order_[row_loop] =
+        ((row_loop << 1) | (row_loop >> rot_bits)) & row_mask_;
+    }
+
+    const int d_row = row_loop;
+    row_address_[d_row] =  (d_row & 0x01) ? h.a : 0;
+    row_address_[d_row] |= (d_row & 0x02) ? h.b : 0;
+    row_address_[d_row] |= (d_row & 0x04) ? h.c : 0;
+    row_address_[d_row] |= (d_row & 0x08) ? h.d : 0;
+    row_address_[d_row] |= (d_row & 0x10) ? h.e : 0;
+  }
+
+  if (scan_mode_ == 2) {
+    // Binary coded modulation with the long pulses interleaved: the top
+    // plane has a sub-pulse in every pass, the one below in every second
+    // pass, starting with the second, and so on. Each pass then has about
+    // the same on-time; the shorter planes go into the first one.
+    passes_ = kSplitPasses;
+    split_plane_ = kBitPlanes - 1 - kSplitBits;
+    pass_planes_[0] = (1 << split_plane_) - 1;
+    for (int pass = 1; pass < passes_; ++pass) pass_planes_[pass] = 0;
+    for (int k = 0; k < kSplitBits + 1; ++k) {
+      const int every = 1 << k;
+      for (int pass = every / 2; pass < passes_; pass += every) {
+        pass_planes_[pass] |= 1 << (kBitPlanes - 1 - k);
+      }
+    }
+  } else {
+    passes_ = 1;
+    split_plane_ = kBitPlanes - 1;
+    pass_planes_[0] = (1 << kBitPlanes) - 1;
+  }
 
   // If we're the first Framebuffer created, the shared PixelMapper is
   // still NULL, so create one.
@@ -107,11 +198,18 @@ Framebuffer::Framebuffer(int rows, int columns, int parallel,
     }
   }
 
+  memset(lit_pixels_, 0, sizeof(lit_pixels_));
   Clear();
 }
 
 Framebuffer::~Framebuffer() {
   delete [] bitplane_buffer_;
+  delete [] output_stream_;
+  delete [] output_stream_generation_;
+  delete [] row_generation_;
+  delete [] cleared_generation_;
+  delete [] copy_source_generation_;
+  delete [] copy_generation_;
 }
 
 // TODO: this should also be parsed from some special formatted string, e.g.
@@ -153,6 +251,10 @@ Framebuffer::~Framebuffer() {
   hardware_mapping_ = mapping;
 }
 
+/* static */ const PinPulser *Framebuffer::output_enable_pulser() {
+  return sOutputEnablePulser;
+}
+
 /* static */ void Framebuffer::InitGPIO(GPIO *io, int rows, int parallel,
                                         bool allow_hardware_pulsing,
                                         int pwm_lsb_nanoseconds) {
@@ -197,6 +299,7 @@ bool Framebuffer::SetPWMBits(uint8_t value) {
   if (value < 1 || value > kBitPlanes)
     return false;
   pwm_bits_ = value;
+  color_lookup_valid_ = false;
   return true;
 }
 
@@ -206,13 +309,26 @@ inline gpio_bits_t *Framebuffer::ValueAt(int double_row, int column, int bit) {
                             + column ];
 }
 
+inline gpio_bits_t *Framebuffer::StreamAt(int double_row, int bit) {
+  return &output_stream_[2 * (double_row * (columns_ * kBitPlanes)
+                              + bit * columns_)];
+}
+
 void Framebuffer::Clear() {
   if (inverse_color_) {
     Fill(0, 0, 0);
   } else  {
     // Cheaper.
-    memset(bitplane_buffer_, 0,
-           sizeof(*bitplane_buffer_) * double_rows_ * columns_ * kBitPlanes);
+    for (int row = 0; row < double_rows_; ++row) {
+      if (fill_key_ == kClearedKey
+          && row_generation_[row] == cleared_generation_[row])
+        continue;  // Still clear.
+      memset(ValueAt(row, 0, 0), 0, row_size());
+      MarkRowChanged(row);
+      cleared_generation_[row] = row_generation_[row];
+    }
+    fill_key_ = kClearedKey;
+    for (int b = 0; b < kBitPlanes; ++b) SetLitPixels(b, 0);
   }
 }
 
@@ -249,24 +365,49 @@ static inline uint16_t DirectMapColor(uint8_t brightness, uint8_t c) {
   return (shift > 0) ? (c << shift) : (c >> -shift);
 }
 
+void Framebuffer::UpdateColorLookup() {
+  const uint16_t shown_planes =
+    ((1 << kBitPlanes) - 1) & ~((1 << (kBitPlanes - pwm_bits_)) - 1);
+  for (int c = 0; c < 256; ++c) {
+    uint16_t bits = do_luminance_correct_
+      ? CIEMapColor(brightness_, c)
+      : DirectMapColor(brightness_, c);
+    if (inverse_color_) bits = ~bits;
+    color_lookup_[c] = bits & shown_planes;
+  }
+  color_lookup_valid_ = true;
+}
+
 inline void Framebuffer::MapColors(
   uint8_t r, uint8_t g, uint8_t b,
   uint16_t *red, uint16_t *green, uint16_t *blue) {
+  if (!color_lookup_valid_) UpdateColorLookup();
+  *red   = color_lookup_[r];
+  *green = color_lookup_[b];
+  *blue  = color_lookup_[g];
+}
 
-  if (do_luminance_correct_) {
-    *red   = CIEMapColor(brightness_, r);
-    *green = CIEMapColor(brightness_, b);
-    *blue  = CIEMapColor(brightness_, g);
-  } else {
-    *red   = DirectMapColor(brightness_, r);
-    *green = DirectMapColor(brightness_, b);
-    *blue  = DirectMapColor(brightness_, g);
-  }
-
-  if (inverse_color_) {
-    *red = ~(*red);
-    *green = ~(*green);
-    *blue = ~(*blue);
+// All writes of a pixel's bitplane words go through here. Each plane is the
+// designator's color bits selected by the plane bits of the mapped colors;
+// the selects compile to conditional moves, not branches. Whether the pixel
+// got lit or dark in each plane is added to "lit_delta".
+inline void Framebuffer::WritePixel(const PixelDesignator &d,
+                                    uint16_t red, uint16_t green,
+                                    uint16_t blue, int32_t *lit_delta) {
+  const int min_bit_plane = kBitPlanes - pwm_bits_;
+  gpio_bits_t *bits = bitplane_buffer_ + d.gpio_word
+    + columns_ * min_bit_plane;
+  // Local copies: the compiler can't know the stores don't alias them.
+  const gpio_bits_t r_bits = d.r_bit, g_bits = d.g_bit, b_bits = d.b_bit;
+  const gpio_bits_t designator_mask = d.mask;
+  for (int b = min_bit_plane; b < kBitPlanes; ++b, bits += columns_) {
+    const uint16_t mask = 1 << b;
+    const gpio_bits_t color = ((red & mask)   ? r_bits : 0)
+      | ((green & mask) ? g_bits : 0)
+      | ((blue & mask)  ? b_bits : 0);
+    const gpio_bits_t old = *bits;
+    lit_delta[b] += (color != 0) - ((old & ~designator_mask) != 0);
+    *bits = (old & designator_mask) | color;
   }
 }
 
@@ -279,20 +420,32 @@ void Framebuffer::Fill(uint8_t r, uint8_t g, uint8_t b) {
   gpio_bits_t all_g = h.p0_g1 | h.p0_g2 | h.p1_g1 | h.p1_g2 | h.p2_g1 | h.p2_g2;
   gpio_bits_t all_b = h.p0_b1 | h.p0_b2 | h.p1_b1 | h.p1_b2 | h.p2_b1 | h.p2_b2;
 
+  gpio_bits_t plane_bits[kBitPlanes];
   for (int b = kBitPlanes - pwm_bits_; b < kBitPlanes; ++b) {
     uint16_t mask = 1 << b;
-    gpio_bits_t plane_bits = 0;
-    plane_bits |= ((red & mask) == mask)   ? all_r : 0;
-    plane_bits |= ((green & mask) == mask) ? all_g : 0;
-    plane_bits |= ((blue & mask) == mask)  ? all_b : 0;
+    plane_bits[b] = 0;
+    plane_bits[b] |= ((red & mask) == mask)   ? all_r : 0;
+    plane_bits[b] |= ((green & mask) == mask) ? all_g : 0;
+    plane_bits[b] |= ((blue & mask) == mask)  ? all_b : 0;
+    SetLitPixels(b, plane_bits[b] != 0 ? columns_ * height_ : 0);
+  }
 
-    for (int row = 0; row < double_rows_; ++row) {
+  // Rows still holding the same fill are left alone.
+  const uint64_t key = red | (uint64_t)green << 16 | (uint64_t)blue << 32
+    | (uint64_t)pwm_bits_ << 48;
+  for (int row = 0; row < double_rows_; ++row) {
+    if (fill_key_ == key && row_generation_[row] == cleared_generation_[row])
+      continue;
+    for (int b = kBitPlanes - pwm_bits_; b < kBitPlanes; ++b) {
       uint32_t *row_data = ValueAt(row, 0, b);
       for (int col = 0; col < columns_; ++col) {
-        *row_data++ = plane_bits;
+        *row_data++ = plane_bits[b];
       }
     }
+    MarkRowChanged(row);
+    cleared_generation_[row] = row_generation_[row];
   }
+  fill_key_ = key;
 }
 
 int Framebuffer::width() const { return (*shared_mapper_)->width(); }
@@ -301,27 +454,111 @@ int Framebuffer::height() const { return (*shared_mapper_)->height(); }
 void Framebuffer::SetPixel(int x, int y, uint8_t r, uint8_t g, uint8_t b) {
   const PixelDesignator *designator = (*shared_mapper_)->get(x, y);
   if (designator == NULL) return;
-  const int pos = designator->gpio_word;
-  if (pos < 0) return;  // non-used pixel marker.
+  if (designator->gpio_word < 0) return;  // non-used pixel marker.
 
   uint16_t red, green, blue;
   MapColors(r, g, b, &red, &green, &blue);
+  int32_t lit_delta[kBitPlanes] = { 0 };
+  WritePixel(*designator, red, green, blue, lit_delta);
+  AddLitPixels(lit_delta);
+  MarkRowChanged(designator->gpio_word / row_words_);
+}
 
-  uint32_t *bits = bitplane_buffer_ + pos;
-  const int min_bit_plane = kBitPlanes - pwm_bits_;
-  bits += (columns_ * min_bit_plane);
-  const uint32_t r_bits = designator->r_bit;
-  const uint32_t g_bits = designator->g_bit;
-  const uint32_t b_bits = designator->b_bit;
-  const uint32_t designator_mask = designator->mask;
-  for (uint16_t mask = 1<<min_bit_plane; mask != 1<<kBitPlanes; mask <<=1 ) {
-    uint32_t color_bits = 0;
-    if (red & mask)   color_bits |= r_bits;
-    if (green & mask) color_bits |= g_bits;
-    if (blue & mask)  color_bits |= b_bits;
-    *bits = (*bits & designator_mask) | color_bits;
-    bits += columns_;
+// Like SetPixel() for all set bits, but the color is only mapped once.
+void Framebuffer::SetBitmap(int x, int y, int width, int height,
+                            const uint32_t *rows,
+                            uint8_t r, uint8_t g, uint8_t b) {
+  uint16_t red, green, blue;
+  MapColors(r, g, b, &red, &green, &blue);
+
+  PixelMapper *const mapper = *shared_mapper_;
+  int32_t lit_delta[kBitPlanes] = { 0 };
+  if (width > 32) width = 32;
+  const uint32_t width_mask = (width == 32) ? ~0u : ~(~0u >> width);
+  int first_word = INT_MAX, last_word = -1;
+  for (int row = 0; row < height; ++row) {
+    if (y + row < 0 || y + row >= mapper->height()) continue;
+    uint32_t pixels = rows[row] & width_mask;
+    while (pixels) {
+      const int col = __builtin_clz(pixels);
+      pixels &= ~(0x80000000u >> col);
+      const PixelDesignator *designator = mapper->get(x + col, y + row);
+      if (designator == NULL) continue;
+      if (designator->gpio_word < 0) continue;  // non-used pixel marker.
+      WritePixel(*designator, red, green, blue, lit_delta);
+      first_word = std::min(first_word, designator->gpio_word);
+      last_word = std::max(last_word, designator->gpio_word);
+    }
   }
+  AddLitPixels(lit_delta);
+  if (last_word >= 0) MarkWordsChanged(first_word, last_word);
+}
+
+// Clips the rectangle at *x,*y of *width x *height to the frame. Returns the
+// number of columns and rows cut off at the left and top in *skip_x, *skip_y,
+// and false if nothing is left.
+static bool ClipRect(int frame_width, int frame_height,
+                     int *x, int *y, int *width, int *height,
+                     int *skip_x, int *skip_y) {
+  *skip_x = (*x < 0) ? -*x : 0;
+  *skip_y = (*y < 0) ? -*y : 0;
+  *x += *skip_x; *width -= *skip_x;
+  *y += *skip_y; *height -= *skip_y;
+  *width = std::min(*width, frame_width - *x);
+  *height = std::min(*height, frame_height - *y);
+  return *width > 0 && *height > 0;
+}
+
+void Framebuffer::SetPixels(int x, int y, int width, int height,
+                            const uint8_t *rgb, int stride) {
+  PixelMapper *const mapper = *shared_mapper_;
+  int skip_x, skip_y;
+  if (!ClipRect(mapper->width(), mapper->height(), &x, &y, &width, &height,
+                &skip_x, &skip_y))
+    return;
+  rgb += skip_y * stride + skip_x * 3;
+
+  uint16_t red, green, blue;
+  int32_t lit_delta[kBitPlanes] = { 0 };
+  int first_word = INT_MAX, last_word = -1;
+  for (int row = 0; row < height; ++row) {
+    const PixelDesignator *d = mapper->get(x, y + row);
+    const uint8_t *pixel = rgb + row * stride;
+    for (int i = 0; i < width; ++i, ++d, pixel += 3) {
+      if (d->gpio_word < 0) continue;  // non-used pixel marker.
+      MapColors(pixel[0], pixel[1], pixel[2], &red, &green, &blue);
+      WritePixel(*d, red, green, blue, lit_delta);
+      first_word = std::min(first_word, d->gpio_word);
+      last_word = std::max(last_word, d->gpio_word);
+    }
+  }
+  AddLitPixels(lit_delta);
+  if (last_word >= 0) MarkWordsChanged(first_word, last_word);
+}
+
+void Framebuffer::FillRect(int x, int y, int width, int height,
+                           uint8_t r, uint8_t g, uint8_t b) {
+  PixelMapper *const mapper = *shared_mapper_;
+  int skip_x, skip_y;
+  if (!ClipRect(mapper->width(), mapper->height(), &x, &y, &width, &height,
+                &skip_x, &skip_y))
+    return;
+
+  uint16_t red, green, blue;
+  MapColors(r, g, b, &red, &green, &blue);
+  int32_t lit_delta[kBitPlanes] = { 0 };
+  int first_word = INT_MAX, last_word = -1;
+  for (int row = 0; row < height; ++row) {
+    const PixelDesignator *d = mapper->get(x, y + row);
+    for (int i = 0; i < width; ++i, ++d) {
+      if (d->gpio_word < 0) continue;  // non-used pixel marker.
+      WritePixel(*d, red, green, blue, lit_delta);
+      first_word = std::min(first_word, d->gpio_word);
+      last_word = std::max(last_word, d->gpio_word);
+    }
+  }
+  AddLitPixels(lit_delta);
+  if (last_word >= 0) MarkWordsChanged(first_word, last_word);
 }
 
 // Strange LED-mappings such as RBG or so are handled here.
@@ -391,82 +628,305 @@ void Framebuffer::Serialize(const char **data, size_t *len) const {
   *len = buffer_size_;
 }
 
+// Only double rows that differ are copied, so they are the only ones
+// marked as changed.
 bool Framebuffer::Deserialize(const char *data, size_t len) {
   if (len != buffer_size_) return false;
-  memcpy(bitplane_buffer_, data, len);
+  const size_t row_bytes = row_size();
+  for (int row = 0; row < double_rows_; ++row, data += row_bytes) {
+    gpio_bits_t *row_data = ValueAt(row, 0, 0);
+    if (memcmp(row_data, data, row_bytes) == 0) continue;
+    CountLitPixels(row, -1);
+    memcpy(row_data, data, row_bytes);
+    CountLitPixels(row, 1);
+    MarkRowChanged(row);
+  }
   return true;
 }
 
-void Framebuffer::DumpToMatrix(GPIO *io) {
-  const struct HardwareMapping &h = *hardware_mapping_;
-  gpio_bits_t color_clk_mask = 0;  // Mask of bits while clocking in.
-  color_clk_mask |= h.p0_r1 | h.p0_g1 | h.p0_b1 | h.p0_r2 | h.p0_g2 | h.p0_b2;
-  if (parallel_ >= 2) {
-    color_clk_mask |= h.p1_r1 | h.p1_g1 | h.p1_b1 | h.p1_r2 | h.p1_g2 | h.p1_b2;
+bool Framebuffer::CopyFrom(const Framebuffer &other) {
+  if (other.buffer_size_ != buffer_size_
+      || other.double_rows_ != double_rows_)
+    return false;
+  if (&other == this) return true;
+  const bool same_source = (copy_source_serial_ == other.serial_);
+  copy_source_serial_ = other.serial_;
+  const size_t row_bytes = row_size();
+  for (int row = 0; row < double_rows_; ++row) {
+    // Read before the data: a change in between is copied again next time.
+    const uint32_t source_generation = other.row_generation(row);
+    if (same_source && source_generation == copy_source_generation_[row]
+        && row_generation_[row] == copy_generation_[row])
+      continue;  // Neither side written to since the last copy.
+    // Rows that are the same anyway are not marked, e.g. copying around
+    // between more than two buffers.
+    gpio_bits_t *row_data = ValueAt(row, 0, 0);
+    const gpio_bits_t *source = other.bitplane_buffer_ + row * row_words_;
+    if (memcmp(row_data, source, row_bytes) != 0) {
+      memcpy(row_data, source, row_bytes);
+      MarkRowChanged(row);
+    }
+    copy_source_generation_[row] = source_generation;
+    copy_generation_[row] = row_generation_[row];
   }
-  if (parallel_ >= 3) {
-    color_clk_mask |= h.p2_r1 | h.p2_g1 | h.p2_b1 | h.p2_r2 | h.p2_g2 | h.p2_b2;
+  // Same content, same counts.
+  for (int b = 0; b < kBitPlanes; ++b) SetLitPixels(b, other.lit_pixels(b));
+  return true;
+}
+
+void Framebuffer::AddLitPixels(const int32_t *delta) {
+  for (int b = 0; b < kBitPlanes; ++b) {
+    if (delta[b] != 0) SetLitPixels(b, lit_pixels_[b] + delta[b]);
+  }
+}
+
+void Framebuffer::CountLitPixels(int d_row, int sign) {
+  // The color wires of each pixel in a word: one sub-panel of one chain.
+  const struct HardwareMapping &h = *hardware_mapping_;
+  const gpio_bits_t all_pixels[6] = {
+    h.p0_r1 | h.p0_g1 | h.p0_b1, h.p0_r2 | h.p0_g2 | h.p0_b2,
+    h.p1_r1 | h.p1_g1 | h.p1_b1, h.p1_r2 | h.p1_g2 | h.p1_b2,
+    h.p2_r1 | h.p2_g1 | h.p2_b1, h.p2_r2 | h.p2_g2 | h.p2_b2,
+  };
+  int32_t delta[kBitPlanes];
+  for (int b = 0; b < kBitPlanes; ++b) {
+    const gpio_bits_t *row_data = ValueAt(d_row, 0, b);
+    int32_t lit = 0;
+    for (int col = 0; col < columns_; ++col) {
+      for (int chain = 0; chain < parallel_; ++chain) {
+        for (int sub = 0; sub < SUB_PANELS_; ++sub)
+          lit += (row_data[col] & all_pixels[2 * chain + sub]) != 0;
+      }
+    }
+    delta[b] = sign * lit;
   }
+  AddLitPixels(delta);
+}
 
-  color_clk_mask |= h.clock;
+void Framebuffer::CompileOutputStreamRow(int d_row, int pwm_bits) {
+  const gpio_bits_t clock = hardware_mapping_->clock;
+  const gpio_bits_t color_mask = color_clk_mask_ & ~clock;
+  uint16_t clock_planes = 0;
+  const gpio_bits_t *pulsed = NULL;  // Data of the plane pulsed last.
+  for (int b = kBitPlanes - pwm_bits; b < kBitPlanes; ++b) {
+    const gpio_bits_t *row_data = ValueAt(d_row, 0, b);
+    gpio_bits_t *stream = StreamAt(d_row, b);
+    // Each bitplane starts out with all bits cleared.
+    gpio_bits_t previous = 0;
+    bool same = (pulsed != NULL);
+    for (int col = 0; col < columns_; ++col) {
+      const gpio_bits_t out = row_data[col] & color_mask;
+      *stream++ = (previous & ~out) | clock;  // Also resets the clock.
+      *stream++ = out & ~previous;
+      previous = out;
+      same = same && out == (pulsed[col] & color_mask);
+    }
+    if (!same) clock_planes |= 1 << b;
+    pulsed = row_data;
+  }
+  clock_planes_[d_row] = clock_planes;
+}
 
+void Framebuffer::DumpToMatrix(GPIO *io) {
+  const struct HardwareMapping &h = *hardware_mapping_;
+  const gpio_bits_t clock = h.clock;
   const gpio_bits_t row_mask = h.a | h.b | h.c | h.d | h.e;
 
-  gpio_bits_t row_address;
+  const int pwm_to_show = pwm_bits_;  // Local copy, might change in process.
+  const bool compile_all = (output_stream_pwm_bits_ != pwm_to_show);
+  for (int d_row = 0; d_row < double_rows_; ++d_row) {
+    // Generation read first: changes made while compiling are picked up
+    // with the next refresh.
+    const uint32_t generation = row_generation(d_row);
+    if (compile_all || generation != output_stream_generation_[d_row]) {
+      output_stream_generation_[d_row] = generation;
+      CompileOutputStreamRow(d_row, pwm_to_show);
+    }
+  }
+  output_stream_pwm_bits_ = pwm_to_show;
+
+  // Empty planes at the bottom would only be clocked in to show nothing:
+  // the depth is lowered to the lowest plane with any LED on. With inverse
+  // colors, set bits are LEDs off; there are no empty planes then.
+  int first_plane = kBitPlanes - pwm_to_show;
+  while (!inverse_color_ && first_plane < kBitPlanes - 1
+         && lit_pixels(first_plane) == 0)
+    ++first_plane;
+
+  if (io->simulator() != NULL) io->simulator()->MarkRefresh();
+
+  io->ClearBits(color_clk_mask_);  // The stream starts from all bits low.
+  for (int pass = 0; pass < passes_; ++pass) {
+    for (int row_loop = 0; row_loop < double_rows_; ++row_loop) {
+      const int d_row = scan_order_[row_loop];
+      const gpio_bits_t row_address = row_address_[d_row];
+      const uint16_t planes = pass_planes_[pass];
+      const uint16_t clock_planes = clock_planes_[d_row];
+
+      // Rows can't be switched very quickly without ghosting, so we do the
+      // PWM of one row in the pass before switching rows.
+      int latched = -1;  // Plane of the data latched for this row.
+      for (int b = first_plane; b < kBitPlanes; ++b) {
+        if ((planes & (1 << b)) == 0)
+          continue;
+        const int pulse = (b < split_plane_) ? b : split_plane_;
+
+        // No plane in between differs: the data is still latched.
+        if (latched >= 0
+            && (clock_planes & ((2 << b) - (2 << latched))) == 0) {
+          sOutputEnablePulser->WaitPulseFinished();
+          sOutputEnablePulser->SendPulse(pulse);
+          latched = b;
+          continue;
+        }
+
+        const gpio_bits_t *stream = StreamAt(d_row, b);
+        // While the output enable is still on, we can already clock in the
+        // next data.
+        for (int col = 0; col < columns_; ++col, stream += 2) {
+          io->ClearBits(stream[0]);  // col changes + reset clock
+          io->SetBits(stream[1]);
+          io->SetBits(clock);        // Rising edge: clock color in.
+        }
+        io->ClearBits(color_clk_mask_);    // clock back to normal.
+
+        // OE of the previous row-data must be finished before strobe.
+        sOutputEnablePulser->WaitPulseFinished();
+
+        // Setting address and strobing needs to happen in dark time.
+        io->WriteMaskedBits(row_address, row_mask);  // Set row address
+        io->SetBits(h.strobe);   // Strobe in the previously clocked in row.
+        io->ClearBits(h.strobe);
+
+        // Now switch on for the sleep time necessary for that bit-plane.
+        sOutputEnablePulser->SendPulse(pulse);
+        latched = b;
+      }
+    }
+  }
+  // End the last pulse here. Left running, it would be longer than its
+  // plane's time by whatever happens until the next refresh.
+  sOutputEnablePulser->WaitPulseFinished();
+}
 
-  // info needed for interlace mode.
-  uint8_t rot_bits = 0;
-  switch (double_rows_) {
-  case  4: rot_bits = 1; break;
-  case  8: rot_bits = 2; break;
-  case 16: rot_bits = 3; break;
-  case 32: rot_bits = 4; break;
+// Replays the writes like the panels would: color bits are shifted in with
+// the clock, latched with the strobe and lit for the length of each output
+// enable pulse. The on-times of each double row are summed up over the
+// latest complete refresh, between two refresh marks; rows that weren't
+// pulsed in it are dark.
+bool Framebuffer::DecodeSimulatedOutput(const GPIOSimulator &simulator,
+                                        std::vector<uint8_t> *rgb) {
+  const struct HardwareMapping &h = *hardware_mapping_;
+  // Two refreshes at most PWM bits hold a complete one.
+  int pulses_per_row = 0;
+  for (int pass = 0; pass < passes_; ++pass) {
+    pulses_per_row += __builtin_popcount(pass_planes_[pass]);
+  }
+  const size_t writes_per_refresh = double_rows_ * pulses_per_row
+    * (3 * columns_ + 8) + 1;
+  std::vector<GPIOSimulator::Event> events;
+  simulator.CopyEvents(2 * writes_per_refresh, &events);
+
+  // Wires of the red, green and blue channel of each sub-panel of each chain.
+  const gpio_bits_t chain_wires[3][2][3] = {
+    { { h.p0_r1, h.p0_g1, h.p0_b1 }, { h.p0_r2, h.p0_g2, h.p0_b2 } },
+    { { h.p1_r1, h.p1_g1, h.p1_b1 }, { h.p1_r2, h.p1_g2, h.p1_b2 } },
+    { { h.p2_r1, h.p2_g1, h.p2_b1 }, { h.p2_r2, h.p2_g2, h.p2_b2 } },
+  };
+  const int panels = parallel_ * SUB_PANELS_;
+  std::vector<gpio_bits_t> wires(3 * panels);
+  std::vector<int> first_y(panels);
+  for (int p = 0; p < parallel_; ++p) {
+    for (int s = 0; s < SUB_PANELS_; ++s) {
+      // A single sub-panel is wired like the second one; see
+      // InitDefaultDesignator().
+      const gpio_bits_t *w = chain_wires[p][SUB_PANELS_ == 1 ? 1 : s];
+      const int panel = p * SUB_PANELS_ + s;
+      wires[3 * panel + 0] = GetGpioFromLedSequence('R', w[0], w[1], w[2]);
+      wires[3 * panel + 1] = GetGpioFromLedSequence('G', w[0], w[1], w[2]);
+      wires[3 * panel + 2] = GetGpioFromLedSequence('B', w[0], w[1], w[2]);
+      first_y[panel] = p * rows_ + s * double_rows_;
+    }
   }
 
-  const int pwm_to_show = pwm_bits_;  // Local copy, might change in process.
-  for (uint8_t row_loop = 0; row_loop < double_rows_; ++row_loop) {
-    uint8_t d_row;
-    switch (scan_mode_) {
-    case 0:  // progressive
-    default:
-      d_row = row_loop;
+  rgb->assign(3 * columns_ * height_, 0);
+  bool decoded = false;
+
+  std::vector<gpio_bits_t> shift_register(columns_, 0);
+  uint64_t clocks = 0;
+  std::vector<gpio_bits_t> latched(columns_, 0);
+  // Per double row, panel, column and color.
+  const int row_values = 3 * panels * columns_;
+  std::vector<uint32_t> on_time(double_rows_ * row_values, 0);
+  int latched_row = -1;
+  bool full_refresh = false;  // Seen the start of the refresh in on_time.
+  gpio_bits_t out = 0;
+
+  for (size_t i = 0; i < events.size(); ++i) {
+    const GPIOSimulator::Event &e = events[i];
+    switch (e.type) {
+    case GPIOSimulator::CLEAR_BITS:
+      out &= ~e.value;
       break;
 
-    case 1:  // interlaced
-      d_row = ((row_loop << 1) | (row_loop >> rot_bits)) & row_mask_;
+    case GPIOSimulator::SET_BITS: {
+      const gpio_bits_t rising = e.value & ~out;
+      out |= e.value;
+      if (rising & h.clock) {
+        shift_register[clocks++ % columns_] = out;
+      }
+      if (rising & h.strobe) {
+        int row = 0;
+        row |= (out & h.a) ? 0x01 : 0;
+        row |= (out & h.b) ? 0x02 : 0;
+        row |= (out & h.c) ? 0x04 : 0;
+        row |= (out & h.d) ? 0x08 : 0;
+        row |= (out & h.e) ? 0x10 : 0;
+        latched_row = row & row_mask_;
+        for (int col = 0; col < columns_; ++col) {
+          latched[col] = (clocks >= (uint64_t)columns_)
+            ? shift_register[(clocks - columns_ + col) % columns_]
+            : 0;
+        }
+      }
+      break;
     }
 
-    row_address =  (d_row & 0x01) ? h.a : 0;
-    row_address |= (d_row & 0x02) ? h.b : 0;
-    row_address |= (d_row & 0x04) ? h.c : 0;
-    row_address |= (d_row & 0x08) ? h.d : 0;
-    row_address |= (d_row & 0x10) ? h.e : 0;
-
-    // Rows can't be switched very quickly without ghosting, so we do the
-    // full PWM of one row before switching rows.
-    for (int b = kBitPlanes - pwm_to_show; b < kBitPlanes; ++b) {
-      gpio_bits_t *row_data = ValueAt(d_row, 0, b);
-      // While the output enable is still on, we can already clock in the next
-      // data.
-      for (int col = 0; col < columns_; ++col) {
-        const gpio_bits_t &out = *row_data++;
-        io->WriteMaskedBits(out, color_clk_mask);  // col + reset clock
-        io->SetBits(h.clock);               // Rising edge: clock color in.
+    case GPIOSimulator::PULSE:
+      if (latched_row < 0) break;
+      for (int panel = 0; panel < panels; ++panel) {
+        uint32_t *t = &on_time[latched_row * row_values
+                               + 3 * columns_ * panel];
+        for (int col = 0; col < columns_; ++col) {
+          for (int c = 0; c < 3; ++c) {
+            if (latched[col] & wires[3 * panel + c])
+              t[3 * col + c] += 1 << e.pulse;
+          }
+        }
       }
-      io->ClearBits(color_clk_mask);    // clock back to normal.
-
-      // OE of the previous row-data must be finished before strobe.
-      sOutputEnablePulser->WaitPulseFinished();
-
-      // Setting address and strobing needs to happen in dark time.
-      io->WriteMaskedBits(row_address, row_mask);  // Set row address
-      io->SetBits(h.strobe);   // Strobe in the previously clocked in row.
-      io->ClearBits(h.strobe);
+      break;
 
-      // Now switch on for the sleep time necessary for that bit-plane.
-      sOutputEnablePulser->SendPulse(b);
+    case GPIOSimulator::REFRESH:
+      if (full_refresh) {
+        for (int row = 0; row < double_rows_; ++row) {
+          for (int panel = 0; panel < panels; ++panel) {
+            uint8_t *pixel = &(*rgb)[3 * columns_ * (first_y[panel] + row)];
+            const uint32_t *t = &on_time[row * row_values
+                                         + 3 * columns_ * panel];
+            for (int c = 0; c < 3 * columns_; ++c) {
+              const uint32_t value = t[c] >> (kBitPlanes - 8);
+              pixel[c] = value > 255 ? 255 : value;
+            }
+          }
+        }
+        decoded = true;
+      }
+      full_refresh = true;
+      std::fill(on_time.begin(), on_time.end(), 0);
+      break;
     }
   }
+  return decoded;
 }
 }  // namespace internal
 }  // namespace rgb_matrix
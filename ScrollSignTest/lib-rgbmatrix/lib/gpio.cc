@@ -27,6 +27,8 @@
 #include <time.h>
 #include <unistd.h>
 
+#include <algorithm>
+
 // Raspberry 1 and 2 have different base addresses for the periphery
 #define BCM2708_PERI_BASE        0x20000000
 #define BCM2709_PERI_BASE        0x3F000000
@@ -93,10 +95,15 @@ namespace rgb_matrix {
    (1 << 19) | (1 << 20) | (1 << 21) | (1 << 26)
 );
 
-GPIO::GPIO() : output_bits_(0), slowdown_(1), gpio_port_(NULL) {
+GPIO::GPIO() : output_bits_(0), slowdown_(1), gpio_port_(NULL),
+               simulator_(NULL) {
 }
 
 uint32_t GPIO::InitOutputs(uint32_t outputs) {
+  if (simulator_ != NULL) {
+    output_bits_ = outputs & kValidBits;
+    return output_bits_;
+  }
   if (gpio_port_ == NULL) {
     fprintf(stderr, "Attempt to init outputs but not yet Init()-ialized.\n");
     return 0;
@@ -179,6 +186,45 @@ bool GPIO::Init(int slowdown) {
   return true;
 }
 
+bool GPIO::InitSimulated(GPIOSimulator *simulator, int slowdown) {
+  slowdown_ = slowdown;
+  simulator_ = simulator;
+  return true;
+}
+
+static uint64_t RoundUpToPowerOfTwo(uint64_t n) {
+  uint64_t result = 1;
+  while (result < n) result <<= 1;
+  return result;
+}
+
+GPIOSimulator::GPIOSimulator(int capacity, int write_nanoseconds)
+  : events_(new Event[RoundUpToPowerOfTwo(capacity)]),
+    mask_(RoundUpToPowerOfTwo(capacity) - 1),
+    write_ns_(write_nanoseconds), recorded_(0), now_ns_(0) {
+}
+
+GPIOSimulator::~GPIOSimulator() {
+  delete [] events_;
+}
+
+void GPIOSimulator::CopyEvents(size_t max_events,
+                               std::vector<Event> *events) const {
+  const uint64_t capacity = mask_ + 1;
+  const uint64_t wanted = std::min((uint64_t)max_events, capacity);
+  const uint64_t end = events_recorded();
+  const uint64_t begin = end > wanted ? end - wanted : 0;
+  events->resize(end - begin);
+  for (uint64_t i = begin; i < end; ++i) {
+    (*events)[i - begin] = events_[i & mask_];
+  }
+  // The recording thread might have overwritten the oldest ones meanwhile.
+  const uint64_t now_recorded = events_recorded();
+  const uint64_t overwritten = now_recorded > capacity + begin
+    ? std::min(now_recorded - capacity - begin, end - begin) : 0;
+  events->erase(events->begin(), events->begin() + overwritten);
+}
+
 /*
  * We support also other pinouts that don't have the OE- on the hardware
  * PWM output pin, so we need to provide (impefect) 'manual' timing as well.
@@ -187,31 +233,109 @@ bool GPIO::Init(int slowdown) {
 
 // --- PinPulser. Private implementation parts.
 namespace {
+static volatile uint32_t *timer1Mhz = NULL;
+
 // Manual timers.
 class Timers {
 public:
   static bool Init();
-  static void sleep_nanos(long t);
+  // Returns false if it overslept.
+  static bool sleep_nanos(long t);
+  // Busy waits "nanos", calibrated in Init().
+  static void busy_nanos(long nanos);
 };
 
 // Simplest of PinPulsers. Uses somewhat jittery and manual timers
 // to get the timing, but not optimal.
+// Longer pulses are asynchronous like the HardwarePinPulser: they are
+// switched off in WaitPulseFinished(), so the next data can be clocked in
+// meanwhile.
 class TimerBasedPinPulser : public PinPulser {
 public:
   TimerBasedPinPulser(GPIO *io, uint32_t bits,
                       const std::vector<int> &nano_specs)
-    : io_(io), bits_(bits), nano_specs_(nano_specs) {}
+    : io_(io), bits_(bits), nano_specs_(nano_specs), triggered_(false) {}
 
   virtual void SendPulse(int time_spec_number) {
+    const int nanos = nano_specs_[time_spec_number];
+    if (nanos < kMinAsyncNanos) {
+      io_->ClearBits(bits_);
+      const bool on_time = Timers::sleep_nanos(nanos);
+      io_->SetBits(bits_);
+      wait_nanos_ += nanos;
+      if (!on_time) ++overruns_;
+      return;
+    }
     io_->ClearBits(bits_);
-    Timers::sleep_nanos(nano_specs_[time_spec_number]);
+    start_time_ = *timer1Mhz;
+    pulse_usec_ = nanos / 1000;
+    // The counter loop ends up to a microsecond early, half a one on
+    // average; the fraction and that half are busy waited.
+    remainder_nanos_ = nanos % 1000 + 500;
+    triggered_ = true;
+  }
+
+  virtual void WaitPulseFinished() {
+    if (!triggered_) return;
+    const uint32_t wait_start = *timer1Mhz;
+    const int elapsed_usec = wait_start - start_time_;
+    if (elapsed_usec > pulse_usec_) {
+      ++overruns_;  // Too late already: this pulse has been too long.
+    } else {
+      // Like sleep_nanos(): sleep with enough room for the jitter.
+      const int to_sleep = pulse_usec_ - elapsed_usec - 25;
+      if (to_sleep > 0) {
+        struct timespec sleep_time = { 0, 1000 * to_sleep };
+        nanosleep(&sleep_time, NULL);
+      }
+      while ((int)(*timer1Mhz - start_time_) < pulse_usec_) {
+        // busy wait for the last microseconds.
+      }
+      Timers::busy_nanos(remainder_nanos_);
+      if ((int)(*timer1Mhz - start_time_) > pulse_usec_ + 1) ++overruns_;
+    }
     io_->SetBits(bits_);
+    triggered_ = false;
+    wait_nanos_ += 1000 * (uint64_t)(uint32_t)(*timer1Mhz - wait_start);
   }
 
 private:
+  // Shorter pulses would suffer from the resolution of the 1Mhz counter.
+  static const int kMinAsyncNanos = 8000;
+
   GPIO *const io_;
   const uint32_t bits_;
   const std::vector<int> nano_specs_;
+  uint32_t start_time_;
+  int pulse_usec_;
+  int remainder_nanos_;
+  bool triggered_;
+};
+
+// Pulses for the GPIOSimulator. They take no real time, but keep the
+// simulated time just like the hardware pulser: the next data is clocked in
+// while the pulse runs.
+class SimulatedPinPulser : public PinPulser {
+public:
+  SimulatedPinPulser(GPIOSimulator *simulator,
+                     const std::vector<int> &nano_specs)
+    : simulator_(simulator), nano_specs_(nano_specs), pulse_end_ns_(0) {}
+
+  virtual void SendPulse(int time_spec_number) {
+    simulator_->Pulse(time_spec_number, nano_specs_[time_spec_number]);
+    pulse_end_ns_ = simulator_->now_ns() + nano_specs_[time_spec_number];
+  }
+
+  virtual void WaitPulseFinished() {
+    const int64_t now = simulator_->now_ns();
+    if (pulse_end_ns_ > now) wait_nanos_ += pulse_end_ns_ - now;
+    simulator_->WaitUntil(pulse_end_ns_);
+  }
+
+private:
+  GPIOSimulator *const simulator_;
+  const std::vector<int> nano_specs_;
+  int64_t pulse_end_ns_;
 };
 
 static bool LinuxHasModuleLoaded(const char *name) {
@@ -230,13 +354,39 @@ static bool LinuxHasModuleLoaded(const char *name) {
   return found;
 }
 
-static volatile uint32_t *timer1Mhz = NULL;
+// Busy loop iterations per nanosecond, in 1/65536.
+static uint64_t loops_per_nano_q16 = 0;
+
+// Not inlined, so that it is always the code that was calibrated.
+static void __attribute__((noinline)) busy_loop(uint32_t loops) {
+  for (; loops != 0; --loops) {
+    asm volatile("");
+  }
+}
 
-static void sleep_nanos_rpi_1(long nanos);
-static void sleep_nanos_rpi_2(long nanos);
-static void (*busy_sleep_impl)(long) = sleep_nanos_rpi_1;
+static int64_t monotonic_nanos() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Measures the speed of busy_loop() instead of assuming a particular CPU
+// and clock. The fastest of a few runs is used; the others were likely
+// interrupted or ran before the CPU clocked up.
+static void CalibrateBusyLoop() {
+  static const uint32_t kLoops = 1 << 20;
+  int64_t fastest = -1;
+  for (int run = 0; run < 5; ++run) {
+    const int64_t start = monotonic_nanos();
+    busy_loop(kLoops);
+    const int64_t nanos = monotonic_nanos() - start;
+    if (nanos > 0 && (fastest < 0 || nanos < fastest)) fastest = nanos;
+  }
+  loops_per_nano_q16 = ((uint64_t)kLoops << 16) / (fastest > 0 ? fastest : 1);
+}
 
 bool Timers::Init() {
+  if (timer1Mhz != NULL) return true;
   const bool isRPi2 = IsRaspberryPi2();
   uint32_t *timereg = mmap_bcm_register(isRPi2, COUNTER_1Mhz_REGISTER_OFFSET);
   if (timereg == NULL) {
@@ -244,11 +394,11 @@ bool Timers::Init() {
   }
   timer1Mhz = timereg + 1;
 
-  busy_sleep_impl = isRPi2 ? sleep_nanos_rpi_2 : sleep_nanos_rpi_1;
+  CalibrateBusyLoop();
   return true;
 }
 
-void Timers::sleep_nanos(long nanos) {
+bool Timers::sleep_nanos(long nanos) {
   // For smaller durations, we go straight to busy wait.
 
   // For larger duration, we use nanosleep() to give the operating system
@@ -268,29 +418,19 @@ void Timers::sleep_nanos(long nanos) {
     const uint32_t after = *timer1Mhz;
     const long nanoseconds_passed = 1000 * (uint32_t)(after - before);
     if (nanoseconds_passed > nanos) {
-      return;  // darn, missed it.
+      return false;  // darn, missed it.
     } else {
       nanos -= nanoseconds_passed; // remaining time with busy-loop
     }
   }
 
-  busy_sleep_impl(nanos);
-}
-
-static void sleep_nanos_rpi_1(long nanos) {
-  if (nanos < 70) return;
-  // The following loop is determined empirically on a 700Mhz RPi
-  for (uint32_t i = (nanos - 70) >> 2; i != 0; --i) {
-    asm("nop");
-  }
+  busy_nanos(nanos);
+  return true;
 }
 
-static void sleep_nanos_rpi_2(long nanos) {
-  if (nanos < 20) return;
-  // The following loop is determined empirically on a 900Mhz RPi 2
-  for (uint32_t i = (nanos - 20) * 100 / 110; i != 0; --i) {
-    asm("");
-  }
+void Timers::busy_nanos(long nanos) {
+  if (nanos <= 0) return;
+  busy_loop((nanos * loops_per_nano_q16) >> 16);
 }
 
 // A PinPulser that uses the PWM hardware to create accurate pulses.
@@ -394,17 +534,20 @@ public:
     // TODO(hzeller): find if it is possible to get some sort of interrupt from
     //   the hardware once it is done with the pulse. Sounds silly that there is
     //   not.
-    const uint32_t elapsed_usec = *timer1Mhz - start_time_;
+    const uint32_t wait_start = *timer1Mhz;
+    const uint32_t elapsed_usec = wait_start - start_time_;
     const int to_sleep = sleep_hint_ - elapsed_usec - 25;
     if (to_sleep > 0) {
       struct timespec sleep_time = { 0, 1000 * to_sleep };
       nanosleep(&sleep_time, NULL);
+      if ((int)(*timer1Mhz - start_time_) > sleep_hint_) ++overruns_;
     }
     while ((pwm_reg_[PWM_STA] & PWM_STA_EMPT1) == 0) {
       // busy wait until done.
     }
     pwm_reg_[PWM_CTL] = PWM_CTL_USEF1 | PWM_CTL_POLA1 | PWM_CTL_CLRF1;
     triggered_ = false;
+    wait_nanos_ += 1000 * (uint64_t)(uint32_t)(*timer1Mhz - wait_start);
   }
 
 private:
@@ -449,6 +592,9 @@ private:
 PinPulser *PinPulser::Create(GPIO *io, uint32_t gpio_mask,
                              bool allow_hardware_pulsing,
                              const std::vector<int> &nano_wait_spec) {
+  if (io->simulator() != NULL) {
+    return new SimulatedPinPulser(io->simulator(), nano_wait_spec);
+  }
   if (!Timers::Init()) return NULL;
   if (allow_hardware_pulsing && HardwarePinPulser::CanHandle(gpio_mask)) {
     return new HardwarePinPulser(gpio_mask, nano_wait_spec);
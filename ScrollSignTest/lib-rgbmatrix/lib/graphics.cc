@@ -37,6 +37,15 @@ int DrawText(Canvas *c, const Font &font,
   return x - start_x;
 }
 
+int MeasureText(const Font &font, const char *utf8_text, int kerning_offset) {
+  int width = 0;
+  while (*utf8_text) {
+    const uint32_t cp = utf8_next_codepoint(utf8_text);
+    width += font.CharacterAdvance(cp) + kerning_offset;
+  }
+  return width;
+}
+
 // There used to be a symbol without the optional extra_spacing parameter. Let's
 // define this here so that people linking against an old library will still
 // have their code usable. Now: 2017-06-04; can probably be removed in a couple
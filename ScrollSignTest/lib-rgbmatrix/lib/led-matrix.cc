@@ -16,6 +16,8 @@
 #include "led-matrix.h"
 
 #include <assert.h>
+#include <limits.h>
+#include <linux/futex.h>
 #include <math.h>
 #include <pthread.h>
 #include <stdint.h>
@@ -23,7 +25,9 @@
 #include <string.h>
 #include <time.h>
 #include <stdio.h>
-#include <sys/time.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 
 #include "gpio.h"
 #include "thread.h"
@@ -46,83 +50,312 @@
 #endif
 
 namespace rgb_matrix {
+static void FutexWait(uint32_t *address, uint32_t value) {
+  syscall(SYS_futex, address, FUTEX_WAIT_PRIVATE, value, NULL, NULL, 0);
+}
+static void FutexWakeAll(uint32_t *address) {
+  syscall(SYS_futex, address, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+static int64_t MonotonicNanos() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
 // Pump pixels to screen. Needs to be high priority real-time because jitter
+//
+// Frames are handed over triple-buffer style through a single atomic slot,
+// so the realtime thread never waits on a lock held by a render thread.
+// The slot holds a FrameCanvas pointer, tagged with kFreshFrame while it
+// is a published frame not shown yet. At each vsync, the refresh thread
+// exchanges a fresh frame for the one it was showing, which then sits
+// untagged in the slot, free to be drawn on again.
+//
+// Statistics are kept in a block the refresh thread updates after each
+// refresh under a sequence count, so readers never hold it up: they retry
+// if the count changed while they copied.
 class RGBMatrix::UpdateThread : public Thread {
 public:
-  UpdateThread(GPIO *io, FrameCanvas *initial_frame, bool show_refresh)
-    : io_(io), show_refresh_(show_refresh), running_(true),
-      current_frame_(initial_frame), next_frame_(NULL),
-      requested_frame_multiple_(1) {
-    pthread_cond_init(&frame_done_, NULL);
+  UpdateThread(GPIO *io, FrameCanvas *initial_frame)
+    : io_(io), running_(true),
+      current_frame_(initial_frame), frame_slot_(0),
+      requested_frame_multiple_(1), vsync_count_(0), vsync_waiters_(0),
+      frame_done_fd_(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)),
+      stats_sequence_(0), missed_swaps_(0),
+      replaced_fresh_(false), submitted_(0) {
+    memset(&stats_, 0, sizeof(stats_));
+    // Created up front, so no switch goes unsignaled to a waiting producer.
+    if (frame_done_fd_ < 0) {
+      perror("Can't create the frame done eventfd");
+      abort();
+    }
+  }
+  virtual ~UpdateThread() {
+    close(frame_done_fd_);
   }
 
   void Stop() {
-    MutexLock l(&running_mutex_);
-    running_ = false;
+    __atomic_store_n(&running_, false, __ATOMIC_RELEASE);
   }
 
   virtual void Run() {
     unsigned frame_count = 0;
-    while (running()) {
-      struct timeval start, end;
-      if (show_refresh_) {
-        gettimeofday(&start, NULL);
-      }
-
+    int64_t start = MonotonicNanos();
+    while (__atomic_load_n(&running_, __ATOMIC_ACQUIRE)) {
       current_frame_->framebuffer()->DumpToMatrix(io_);
-
-      {
-        MutexLock l(&frame_sync_);
-        // Do fast equality test first (likely due to frame_count reset).
-        if (frame_count == requested_frame_multiple_
-            || frame_count % requested_frame_multiple_ == 0) {
-          // We reset to avoid frame hick-up every couple of weeks
-          // run-time iff requested_frame_multiple_ is not a factor of 2^32.
-          frame_count = 0;
-          if (next_frame_ != NULL) {
-            current_frame_ = next_frame_;
-            next_frame_ = NULL;
-          }
-          pthread_cond_signal(&frame_done_);
+      bool swapped = false;
+
+      const unsigned multiple =
+        __atomic_load_n(&requested_frame_multiple_, __ATOMIC_RELAXED);
+      // Do fast equality test first (likely due to frame_count reset).
+      if (frame_count == multiple || frame_count % multiple == 0) {
+        // We reset to avoid frame hick-up every couple of weeks
+        // run-time iff requested_frame_multiple_ is not a factor of 2^32.
+        frame_count = 0;
+        if (__atomic_load_n(&frame_slot_, __ATOMIC_ACQUIRE) & kFreshFrame) {
+          // Only the producer changes the slot in between, always to a
+          // fresh frame, so we get a fresh one back.
+          const uintptr_t fresh =
+            __atomic_exchange_n(&frame_slot_, (uintptr_t)current_frame_,
+                                __ATOMIC_ACQ_REL);
+          // Read by SwapOnVSync(NULL) from other threads.
+          __atomic_store_n(&current_frame_,
+                           (FrameCanvas*)(fresh & ~kFreshFrame),
+                           __ATOMIC_RELEASE);
+          swapped = true;
+          // Can only fail with the counter full; readers wake up anyway.
+          const uint64_t one = 1;
+          (void)write(frame_done_fd_, &one, sizeof(one));
+        }
+        // Sequentially consistent with the waiter count, so either a waiter
+        // sees the new count or we see the waiter.
+        __atomic_add_fetch(&vsync_count_, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&vsync_waiters_, __ATOMIC_SEQ_CST) > 0) {
+          FutexWakeAll(&vsync_count_);
         }
       }
 
       ++frame_count;
 
-      if (show_refresh_) {
-        gettimeofday(&end, NULL);
-        int64_t usec = ((uint64_t)end.tv_sec * 1000000 + end.tv_usec)
-          - ((int64_t)start.tv_sec * 1000000 + start.tv_usec);
-        printf("\b\b\b\b\b\b\b\b%6.1fHz", 1e6 / usec);
-      }
+      // One clock reading per refresh: it ends where the next one starts.
+      const int64_t end = MonotonicNanos();
+      UpdateStats(end - start, swapped);
+      start = end;
+    }
+  }
+
+  void GetStats(RefreshStats *stats) const {
+    for (;;) {
+      const uint32_t before = __atomic_load_n(&stats_sequence_,
+                                              __ATOMIC_ACQUIRE);
+      if (before & 1) continue;  // Being updated right now.
+      *stats = stats_;
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      if (__atomic_load_n(&stats_sequence_, __ATOMIC_RELAXED) == before)
+        break;
     }
+    stats->missed_swaps = __atomic_load_n(&missed_swaps_, __ATOMIC_RELAXED);
+  }
+
+  // Publishes "frame" to be shown from the next vsync on. Never blocks.
+  // Returns a FrameCanvas the refresh is done with: one published before
+  // but never shown, one it switched away from or NULL if there is none.
+  FrameCanvas *Publish(FrameCanvas *frame) {
+    const uintptr_t previous =
+      __atomic_exchange_n(&frame_slot_, (uintptr_t)frame | kFreshFrame,
+                          __ATOMIC_ACQ_REL);
+    replaced_fresh_ = (previous & kFreshFrame) != 0;
+    return (FrameCanvas*)(previous & ~kFreshFrame);
   }
 
   FrameCanvas *SwapOnVSync(FrameCanvas *other, unsigned frame_fraction) {
-    MutexLock l(&frame_sync_);
-    FrameCanvas *previous = current_frame_;
-    next_frame_ = other;
-    requested_frame_multiple_ = frame_fraction;
-    frame_sync_.WaitOn(&frame_done_);
-    return previous;
+    __atomic_store_n(&requested_frame_multiple_, frame_fraction,
+                     __ATOMIC_RELAXED);
+    if (other == NULL) {
+      WaitForVSync(__atomic_load_n(&vsync_count_, __ATOMIC_ACQUIRE));
+      return __atomic_load_n(&current_frame_, __ATOMIC_ACQUIRE);
+    }
+    FrameCanvas *const previous = Publish(other);
+    if (previous) free_frames_.push_back(previous);  // From SubmitFrame().
+    if (previous && replaced_fresh_) CountMissedSwap();
+    // Wait until the refresh switched over and left the former frame in
+    // the slot for us to take.
+    const uintptr_t fresh = (uintptr_t)other | kFreshFrame;
+    uint32_t count = __atomic_load_n(&vsync_count_, __ATOMIC_ACQUIRE);
+    while (__atomic_load_n(&frame_slot_, __ATOMIC_ACQUIRE) == fresh) {
+      count = WaitForVSync(count);
+    }
+    return (FrameCanvas*)__atomic_exchange_n(&frame_slot_, 0,
+                                             __ATOMIC_ACQ_REL);
+  }
+
+  // -- Non-blocking submission. Like SwapOnVSync(), only to be used from
+  // one thread at a time.
+  uint32_t SubmitFrame(FrameCanvas *frame, unsigned frame_fraction) {
+    __atomic_store_n(&requested_frame_multiple_, frame_fraction,
+                     __ATOMIC_RELAXED);
+    FrameCanvas *const previous = Publish(frame);
+    if (previous) free_frames_.push_back(previous);
+    if (replaced_fresh_) CountMissedSwap();
+    return ++submitted_;
   }
 
+  // Only the latest submitted frame can still be waiting in the slot.
+  bool FramePending(uint32_t ticket) const {
+    return ticket == submitted_
+      && (__atomic_load_n(&frame_slot_, __ATOMIC_ACQUIRE) & kFreshFrame);
+  }
+
+  FrameCanvas *TakeFreeFrame() {
+    if (!free_frames_.empty()) {
+      FrameCanvas *result = free_frames_.back();
+      free_frames_.pop_back();
+      return result;
+    }
+    // A frame released by the refresh. It doesn't touch untagged slots,
+    // so this can't race with it.
+    uintptr_t slot = __atomic_load_n(&frame_slot_, __ATOMIC_ACQUIRE);
+    if (slot == 0 || (slot & kFreshFrame)) return NULL;
+    __atomic_store_n(&frame_slot_, 0, __ATOMIC_RELAXED);
+    return (FrameCanvas*) slot;
+  }
+
+  int FrameDoneFd() const { return frame_done_fd_; }
+
 private:
-  inline bool running() {
-    MutexLock l(&running_mutex_);
-    return running_;
+  static const uintptr_t kFreshFrame = 1;  // FrameCanvas* are aligned.
+
+  void UpdateStats(int64_t refresh_nanos, bool swapped) {
+    const PinPulser *pulser = internal::Framebuffer::output_enable_pulser();
+    int bucket = 0;
+    for (int64_t usec = refresh_nanos / 2000; usec > 0; usec >>= 1) {
+      ++bucket;
+    }
+    if (bucket >= RefreshStats::kHistogramBuckets) {
+      bucket = RefreshStats::kHistogramBuckets - 1;
+    }
+    // Odd sequence count while we change the block.
+    __atomic_store_n(&stats_sequence_, stats_sequence_ + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    stats_.refreshes++;
+    stats_.refresh_nanos += refresh_nanos;
+    stats_.refresh_histogram[bucket]++;
+    if (pulser) {
+      stats_.pulse_wait_nanos = pulser->wait_nanos();
+      stats_.pulse_overruns = pulser->overruns();
+    }
+    if (swapped) stats_.swaps++;
+    __atomic_store_n(&stats_sequence_, stats_sequence_ + 1, __ATOMIC_RELEASE);
+  }
+
+  void CountMissedSwap() {
+    __atomic_store_n(&missed_swaps_, missed_swaps_ + 1, __ATOMIC_RELAXED);
+  }
+
+  // Waits until the vsync count is past "count"; returns the new one.
+  uint32_t WaitForVSync(uint32_t count) {
+    __atomic_add_fetch(&vsync_waiters_, 1, __ATOMIC_SEQ_CST);
+    uint32_t now;
+    while ((now = __atomic_load_n(&vsync_count_, __ATOMIC_SEQ_CST)) == count) {
+      FutexWait(&vsync_count_, count);
+    }
+    __atomic_sub_fetch(&vsync_waiters_, 1, __ATOMIC_SEQ_CST);
+    return now;
   }
 
   GPIO *const io_;
-  const bool show_refresh_;
-  Mutex running_mutex_;
   bool running_;
 
-  Mutex frame_sync_;
-  pthread_cond_t frame_done_;
-  FrameCanvas *current_frame_;
-  FrameCanvas *next_frame_;
+  FrameCanvas *current_frame_;   // Only changed by the refresh thread.
+  uintptr_t frame_slot_;
   unsigned requested_frame_multiple_;
+
+  uint32_t vsync_count_;         // Futex: incremented at each vsync.
+  int vsync_waiters_;
+  const int frame_done_fd_;      // eventfd, written when the slot frees.
+
+  uint32_t stats_sequence_;      // Odd while stats_ is being updated.
+  RefreshStats stats_;           // Without missed_swaps.
+  uint32_t missed_swaps_;        // Written by the thread submitting frames.
+
+  // Only used by the thread submitting frames.
+  bool replaced_fresh_;          // Whether Publish() replaced a fresh frame.
+  uint32_t submitted_;
+  std::vector<FrameCanvas*> free_frames_;
+};
+
+// Reports the refresh statistics from an ordinary thread, so the realtime
+// thread never does any output itself: every second the refresh rate on
+// the terminal, every few seconds all statistics to a file.
+class RGBMatrix::StatsDumper : public Thread {
+public:
+  StatsDumper(const UpdateThread *updater, bool show_refresh,
+              const char *stats_file)
+    : updater_(updater), show_refresh_(show_refresh), stats_file_(stats_file),
+      running_(true) {
+    memset(&last_, 0, sizeof(last_));
+  }
+
+  void Stop() {
+    __atomic_store_n(&running_, false, __ATOMIC_RELEASE);
+  }
+
+  virtual void Run() {
+    static const int kFileEverySeconds = 5;
+    for (int seconds = 1; Sleep(); ++seconds) {
+      RefreshStats stats;
+      updater_->GetStats(&stats);
+      const uint64_t refreshes = stats.refreshes - last_.refreshes;
+      const uint64_t nanos = stats.refresh_nanos - last_.refresh_nanos;
+      const float hz = nanos > 0 ? 1e9 * refreshes / nanos : 0;
+      if (show_refresh_) {
+        printf("\b\b\b\b\b\b\b\b%6.1fHz", hz);
+        fflush(stdout);
+      }
+      if (stats_file_ && seconds % kFileEverySeconds == 0) {
+        WriteFile(stats, hz);
+      }
+      last_ = stats;
+    }
+  }
+
+private:
+  // Sleeps a second, but wakes up early to stop. Returns false if stopped.
+  bool Sleep() {
+    for (int i = 0; i < 10; ++i) {
+      if (!__atomic_load_n(&running_, __ATOMIC_ACQUIRE)) return false;
+      struct timespec sleep_time = { 0, 100 * 1000 * 1000 };
+      nanosleep(&sleep_time, NULL);
+    }
+    return __atomic_load_n(&running_, __ATOMIC_ACQUIRE);
+  }
+
+  // Written to a temporary file first, so readers never see half of it.
+  void WriteFile(const RefreshStats &stats, float hz) {
+    const std::string tmp_file = std::string(stats_file_) + ".tmp";
+    FILE *f = fopen(tmp_file.c_str(), "w");
+    if (f == NULL) return;
+    fprintf(f, "refresh_hz %.1f\n", hz);
+    fprintf(f, "refreshes %llu\n", (unsigned long long)stats.refreshes);
+    for (int i = 0; i < RefreshStats::kHistogramBuckets; ++i) {
+      fprintf(f, "refresh_usec_%d %llu\n", 1 << i,
+              (unsigned long long)stats.refresh_histogram[i]);
+    }
+    fprintf(f, "pulse_wait_usec %llu\n",
+            (unsigned long long)stats.pulse_wait_nanos / 1000);
+    fprintf(f, "pulse_overruns %llu\n",
+            (unsigned long long)stats.pulse_overruns);
+    fprintf(f, "swaps %llu\n", (unsigned long long)stats.swaps);
+    fprintf(f, "missed_swaps %llu\n", (unsigned long long)stats.missed_swaps);
+    if (fclose(f) == 0) rename(tmp_file.c_str(), stats_file_);
+  }
+
+  const UpdateThread *const updater_;
+  const bool show_refresh_;
+  const char *const stats_file_;
+  bool running_;
+  RefreshStats last_;
 };
 
 // Some defaults. See options-initialize.cc for the command line parsing.
@@ -164,6 +397,8 @@ RGBMatrix::Options::Options() :
     show_refresh_rate(false),
 #endif
 
+    refresh_stats_file(NULL),
+
 #ifdef INVERSE_RGB_DISPLAY_COLORS
     inverse_colors(true),
 #else
@@ -175,7 +410,8 @@ RGBMatrix::Options::Options() :
 }
 
 RGBMatrix::RGBMatrix(GPIO *io, const Options &options)
-  : params_(options), io_(NULL), updater_(NULL), shared_pixel_mapper_(NULL) {
+  : params_(options), io_(NULL), updater_(NULL), stats_dumper_(NULL),
+    shared_pixel_mapper_(NULL) {
   assert(params_.Validate(NULL));
   internal::Framebuffer::InitHardwareMapping(params_.hardware_mapping);
   active_ = CreateFrameCanvas();
@@ -186,7 +422,8 @@ RGBMatrix::RGBMatrix(GPIO *io, const Options &options)
 
 RGBMatrix::RGBMatrix(GPIO *io, int rows, int chained_displays,
                      int parallel_displays)
-  : params_(Options()), io_(NULL), updater_(NULL), shared_pixel_mapper_(NULL) {
+  : params_(Options()), io_(NULL), updater_(NULL), stats_dumper_(NULL),
+    shared_pixel_mapper_(NULL) {
   params_.rows = rows;
   params_.chain_length = chained_displays;
   params_.parallel = parallel_displays;
@@ -199,6 +436,11 @@ RGBMatrix::RGBMatrix(GPIO *io, int rows, int chained_displays,
 }
 
 RGBMatrix::~RGBMatrix() {
+  if (stats_dumper_) {
+    stats_dumper_->Stop();
+    stats_dumper_->WaitStopped();
+    delete stats_dumper_;
+  }
   updater_->Stop();
   updater_->WaitStopped();
   delete updater_;
@@ -227,7 +469,7 @@ void RGBMatrix::SetGPIO(GPIO *io, bool start_thread) {
 
 bool RGBMatrix::StartRefresh() {
   if (updater_ == NULL && io_ != NULL) {
-    updater_ = new UpdateThread(io_, active_, params_.show_refresh_rate);
+    updater_ = new UpdateThread(io_, active_);
     // If we have multiple processors, the kernel
     // jumps around between these, creating some global flicker.
     // So let's tie it to the last CPU available.
@@ -235,11 +477,40 @@ bool RGBMatrix::StartRefresh() {
     //   core #3 will succeed.
     // The Raspberry Pi1 only has one core, so this affinity
     //   call will simply fail and we keep using the only core.
-    updater_->Start(99, (1<<3));  // Prio: high. Also: put on last CPU.
+    if (io_->simulator() != NULL) {
+      // Simulated output never sleeps; as realtime thread, it would starve
+      // everything else on a single core.
+      updater_->Start();
+    } else {
+      updater_->Start(99, (1<<3));  // Prio: high. Also: put on last CPU.
+    }
+  }
+  if (stats_dumper_ == NULL && updater_ != NULL
+      && (params_.show_refresh_rate || params_.refresh_stats_file)) {
+    stats_dumper_ = new StatsDumper(updater_, params_.show_refresh_rate,
+                                    params_.refresh_stats_file);
+    stats_dumper_->Start();
   }
   return updater_ != NULL;
 }
 
+void RGBMatrix::GetRefreshStats(RefreshStats *stats) const {
+  if (updater_ == NULL) {
+    memset(stats, 0, sizeof(*stats));
+    return;
+  }
+  updater_->GetStats(stats);
+}
+
+const GPIOSimulator *RGBMatrix::gpio_simulator() const {
+  return io_ != NULL ? io_->simulator() : NULL;
+}
+
+bool RGBMatrix::DecodeSimulatedFrame(std::vector<uint8_t> *rgb) const {
+  if (gpio_simulator() == NULL) return false;
+  return active_->framebuffer()->DecodeSimulatedOutput(*gpio_simulator(), rgb);
+}
+
 FrameCanvas *RGBMatrix::CreateFrameCanvas() {
   FrameCanvas *result =
     new FrameCanvas(new internal::Framebuffer(params_.rows,
@@ -270,6 +541,25 @@ FrameCanvas *RGBMatrix::SwapOnVSync(FrameCanvas *other,
   return previous;
 }
 
+uint32_t RGBMatrix::SubmitFrame(FrameCanvas *frame, unsigned frame_fraction) {
+  if (frame_fraction == 0) frame_fraction = 1; // correct user error.
+  const uint32_t ticket = updater_->SubmitFrame(frame, frame_fraction);
+  active_ = frame;
+  return ticket;
+}
+
+bool RGBMatrix::FramePending(uint32_t ticket) const {
+  return updater_->FramePending(ticket);
+}
+
+FrameCanvas *RGBMatrix::TakeFreeFrame() {
+  return updater_->TakeFreeFrame();
+}
+
+int RGBMatrix::frame_done_fd() const {
+  return updater_->FrameDoneFd();
+}
+
 bool RGBMatrix::SetPWMBits(uint8_t value) {
   const bool success = active_->framebuffer()->SetPWMBits(value);
   if (success) {
@@ -310,6 +600,22 @@ void RGBMatrix::SetPixel(int x, int y, uint8_t red, uint8_t green, uint8_t blue)
   active_->SetPixel(x, y, red, green, blue);
 }
 
+void RGBMatrix::SetBitmap(int x, int y, int width, int height,
+                          const uint32_t *rows,
+                          uint8_t red, uint8_t green, uint8_t blue) {
+  active_->SetBitmap(x, y, width, height, rows, red, green, blue);
+}
+
+void RGBMatrix::SetPixels(int x, int y, int width, int height,
+                          const uint8_t *rgb, int stride) {
+  active_->SetPixels(x, y, width, height, rgb, stride);
+}
+
+void RGBMatrix::FillRect(int x, int y, int width, int height,
+                         uint8_t red, uint8_t green, uint8_t blue) {
+  active_->FillRect(x, y, width, height, red, green, blue);
+}
+
 void RGBMatrix::Clear() {
   active_->Clear();
 }
@@ -396,6 +702,19 @@ void FrameCanvas::SetPixel(int x, int y,
                          uint8_t red, uint8_t green, uint8_t blue) {
   frame_->SetPixel(x, y, red, green, blue);
 }
+void FrameCanvas::SetBitmap(int x, int y, int width, int height,
+                            const uint32_t *rows,
+                            uint8_t red, uint8_t green, uint8_t blue) {
+  frame_->SetBitmap(x, y, width, height, rows, red, green, blue);
+}
+void FrameCanvas::SetPixels(int x, int y, int width, int height,
+                            const uint8_t *rgb, int stride) {
+  frame_->SetPixels(x, y, width, height, rgb, stride);
+}
+void FrameCanvas::FillRect(int x, int y, int width, int height,
+                           uint8_t red, uint8_t green, uint8_t blue) {
+  frame_->FillRect(x, y, width, height, red, green, blue);
+}
 void FrameCanvas::Clear() { return frame_->Clear(); }
 void FrameCanvas::Fill(uint8_t red, uint8_t green, uint8_t blue) {
   frame_->Fill(red, green, blue);
@@ -416,5 +735,11 @@ void FrameCanvas::Serialize(const char **data, size_t *len) const {
 bool FrameCanvas::Deserialize(const char *data, size_t len) {
   return frame_->Deserialize(data, len);
 }
+bool FrameCanvas::CopyFrom(const FrameCanvas &other) {
+  return frame_->CopyFrom(*other.frame_);
+}
+void FrameCanvas::LoadRGB(const uint8_t *rgb, int stride) {
+  frame_->LoadRGB(rgb, stride);
+}
 
 }  // end namespace rgb_matrix
@@ -34,7 +34,8 @@ RuntimeOptions::RuntimeOptions() :
 #endif
   daemon(0),            // Don't become a daemon by default.
   drop_privileges(1),    // Encourage good practice: drop privileges by default.
-  do_gpio_init(true)
+  do_gpio_init(true),
+  gpio_backend("rpi")
 {
   // Nothing to see here.
 }
@@ -42,6 +43,10 @@ RuntimeOptions::RuntimeOptions() :
 namespace {
 typedef char** argv_iterator;
 
+// Rough time of one GPIO register write on a Raspberry Pi 3, only used to
+// model the refresh timing with the simulated backend.
+static const int kSimulatedWriteNanos = 20;
+
 #define OPTION_PREFIX     "--led-"
 #define OPTION_PREFIX_LEN strlen(OPTION_PREFIX)
 
@@ -162,6 +167,9 @@ static bool FlagInit(int &argc, char **&argv,
         continue;
       if (ConsumeBoolFlag("show-refresh", it, &mopts->show_refresh_rate))
         continue;
+      if (ConsumeStringFlag("refresh-stats", it, end,
+                            &mopts->refresh_stats_file, &err))
+        continue;
       if (ConsumeBoolFlag("inverse", it, &mopts->inverse_colors))
         continue;
       // We don't have a swap_green_blue option anymore, but we simulate the
@@ -193,6 +201,9 @@ static bool FlagInit(int &argc, char **&argv,
       //-- Runtime options.
       if (ConsumeIntFlag("slowdown-gpio", it, end, &ropts->gpio_slowdown, &err))
         continue;
+      if (ConsumeStringFlag("gpio-backend", it, end,
+                            &ropts->gpio_backend, &err))
+        continue;
       if (ropts->daemon >= 0 && ConsumeBoolFlag("daemon", it, &bool_scratch)) {
         ropts->daemon = bool_scratch ? 1 : 0;
         continue;
@@ -276,7 +287,15 @@ RGBMatrix *CreateMatrixFromOptions(const RGBMatrix::Options &options,
     return NULL;
   }
 
-  if (runtime_options.do_gpio_init && getuid() != 0) {
+  const char *backend = runtime_options.gpio_backend;
+  const bool simulated = (backend != NULL && strcmp(backend, "sim") == 0);
+  if (!simulated && backend != NULL && strcmp(backend, "rpi") != 0) {
+    fprintf(stderr, "Unknown --led-gpio-backend=%s; "
+            "choose 'rpi' or 'sim'.\n", backend);
+    return NULL;
+  }
+
+  if (runtime_options.do_gpio_init && !simulated && getuid() != 0) {
     fprintf(stderr, "Must run as root to be able to access /dev/mem\n"
             "Prepend 'sudo' to the command\n");
     return NULL;
@@ -289,8 +308,18 @@ RGBMatrix *CreateMatrixFromOptions(const RGBMatrix::Options &options,
   }
 
   static GPIO io;  // This static var is a little bit icky.
-  if (runtime_options.do_gpio_init &&
-      !io.Init(runtime_options.gpio_slowdown)) {
+  if (runtime_options.do_gpio_init && simulated) {
+    // Room for four refreshes at full PWM bits: decoding looks at the last
+    // two, the other two leave room for what the refresh records meanwhile.
+    // Scan mode 2 has up to twice the pulses.
+    const int writes_per_refresh = (options.rows / 2) * 11
+      * (options.scan_mode == 2 ? 2 : 1)
+      * (3 * 32 * options.chain_length + 8);
+    static GPIOSimulator simulator(4 * writes_per_refresh,
+                                   kSimulatedWriteNanos);
+    io.InitSimulated(&simulator, runtime_options.gpio_slowdown);
+  } else if (runtime_options.do_gpio_init &&
+             !io.Init(runtime_options.gpio_slowdown)) {
     return NULL;
   }
 
@@ -343,9 +372,11 @@ void PrintMatrixFlags(FILE *out, const RGBMatrix::Options &d,
           "chains. range=1..3 (Default: %d).\n"
           "\t--led-pwm-bits=<1..11>    : PWM bits (Default: %d).\n"
           "\t--led-brightness=<percent>: Brightness in percent (Default: %d).\n"
-          "\t--led-scan-mode=<0..1>    : 0 = progressive; 1 = interlaced "
-          "(Default: %d).\n"
+          "\t--led-scan-mode=<0..2>    : 0 = progressive; 1 = interlaced; "
+          "2 = split pulses (Default: %d).\n"
           "\t--led-%sshow-refresh        : %show refresh rate.\n"
+          "\t--led-refresh-stats=<file>: Write refresh statistics to file "
+          "every few seconds.\n"
           "\t--led-%sinverse             "
           ": Switch if your matrix has inverse colors %s.\n"
           "\t--led-rgb-sequence        : Switch if your matrix has led colors "
@@ -365,6 +396,9 @@ void PrintMatrixFlags(FILE *out, const RGBMatrix::Options &d,
   fprintf(out, "\t--led-slowdown-gpio=<0..2>: "
           "Slowdown GPIO. Needed for faster Pis and/or slower panels "
           "(Default: %d).\n", r.gpio_slowdown);
+  fprintf(out, "\t--led-gpio-backend=<rpi|sim>: "
+          "Raspberry Pi GPIO or simulated output without hardware "
+          "(Default: %s).\n", r.gpio_backend);
   if (r.daemon >= 0) {
     const bool on = (r.daemon > 0);
     fprintf(out,
@@ -411,8 +445,8 @@ bool RGBMatrix::Options::Validate(std::string *err_in) const {
     success = false;
   }
 
-  if (scan_mode < 0 || scan_mode > 1) {
-    err->append("Invalid scan mode (0 or 1 allowed).\n");
+  if (scan_mode < 0 || scan_mode > 2) {
+    err->append("Invalid scan mode (0, 1 or 2 allowed).\n");
     success = false;
   }
 
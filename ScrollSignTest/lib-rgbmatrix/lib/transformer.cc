@@ -17,6 +17,8 @@
 #include <assert.h>
 #include <stdio.h>
 
+#include <algorithm>
+
 #include "transformer.h"
 
 namespace rgb_matrix {
@@ -34,6 +36,10 @@ public:
   virtual int width() const;
   virtual int height() const;
   virtual void SetPixel(int x, int y, uint8_t red, uint8_t green, uint8_t blue);
+  virtual void SetPixels(int x, int y, int width, int height,
+                         const uint8_t *rgb, int stride);
+  virtual void FillRect(int x, int y, int width, int height,
+                        uint8_t red, uint8_t green, uint8_t blue);
   virtual void Clear();
   virtual void Fill(uint8_t red, uint8_t green, uint8_t blue);
 
@@ -71,6 +77,43 @@ void RotateTransformer::TransformCanvas::SetPixel(int x, int y, uint8_t red, uin
   }
 }
 
+void RotateTransformer::TransformCanvas::SetPixels(int x, int y,
+                                                   int width, int height,
+                                                   const uint8_t *rgb,
+                                                   int stride) {
+  if (angle_ == 0) {
+    delegatee_->SetPixels(x, y, width, height, rgb, stride);
+  } else {
+    // Rows become columns or are reversed; go pixel by pixel.
+    Canvas::SetPixels(x, y, width, height, rgb, stride);
+  }
+}
+
+void RotateTransformer::TransformCanvas::FillRect(int x, int y,
+                                                  int width, int height,
+                                                  uint8_t red, uint8_t green,
+                                                  uint8_t blue) {
+  // A rectangle stays a rectangle, just with its corners mapped.
+  switch (angle_) {
+  case 0:
+    delegatee_->FillRect(x, y, width, height, red, green, blue);
+    break;
+  case 90:
+    delegatee_->FillRect(delegatee_->width() - y - height, x, height, width,
+                         red, green, blue);
+    break;
+  case 180:
+    delegatee_->FillRect(delegatee_->width() - x - width,
+                         delegatee_->height() - y - height, width, height,
+                         red, green, blue);
+    break;
+  case 270:
+    delegatee_->FillRect(y, delegatee_->height() - x - width, height, width,
+                         red, green, blue);
+    break;
+  }
+}
+
 int RotateTransformer::TransformCanvas::width() const {
   return (angle_ % 180 == 0) ? delegatee_->width() : delegatee_->height();
 }
@@ -156,8 +199,19 @@ public:
   virtual int width() const { return width_; }
   virtual int height() const { return height_; }
   virtual void SetPixel(int x, int y, uint8_t red, uint8_t green, uint8_t blue);
+  virtual void SetPixels(int x, int y, int width, int height,
+                         const uint8_t *rgb, int stride);
+  virtual void FillRect(int x, int y, int width, int height,
+                        uint8_t red, uint8_t green, uint8_t blue);
 
 private:
+  // Clips the span of "width" pixels at x in row y. Returns false if
+  // nothing is left, otherwise the number of pixels cut off at the left in
+  // *skip and where the span starts in the delegatee in *out_x, *out_y.
+  // Spans in the lower half of a fold run right to left there (*reversed).
+  bool MapSpan(int *x, int y, int *width, int *skip,
+               int *out_x, int *out_y, bool *reversed) const;
+
   const int parallel_;
   int width_;
   int height_;
@@ -205,6 +259,61 @@ void UArrangementTransformer::TransformCanvas::SetPixel(
   delegatee_->SetPixel(x, base_y + y, red, green, blue);
 }
 
+bool UArrangementTransformer::TransformCanvas::MapSpan(
+  int *x, int y, int *width, int *skip,
+  int *out_x, int *out_y, bool *reversed) const {
+  if (y < 0 || y >= height_) return false;
+  *skip = (*x < 0) ? -*x : 0;
+  *x += *skip;
+  *width = std::min(*width - *skip, width_ - *x);
+  if (*width <= 0) return false;
+  const int slab_height = 2*panel_height_;   // one folded u-shape
+  const int base_y = (y / slab_height) * panel_height_;
+  y %= slab_height;
+  *reversed = (y >= panel_height_);
+  if (!*reversed) {
+    *out_x = *x + delegatee_->width() / 2;
+    *out_y = base_y + y;
+  } else {
+    *out_x = width_ - *x - 1;   // Rightmost delegatee pixel of the span.
+    *out_y = base_y + slab_height - y - 1;
+  }
+  return true;
+}
+
+void UArrangementTransformer::TransformCanvas::SetPixels(
+  int x, int y, int width, int height, const uint8_t *rgb, int stride) {
+  for (int row = 0; row < height; ++row) {
+    int span_x = x, span_width = width, skip, out_x, out_y;
+    bool reversed;
+    if (!MapSpan(&span_x, y + row, &span_width, &skip,
+                 &out_x, &out_y, &reversed))
+      continue;
+    const uint8_t *pixel = rgb + row * stride + skip * 3;
+    if (!reversed) {
+      delegatee_->SetPixels(out_x, out_y, span_width, 1, pixel, stride);
+    } else {
+      for (int i = 0; i < span_width; ++i, pixel += 3) {
+        delegatee_->SetPixel(out_x - i, out_y, pixel[0], pixel[1], pixel[2]);
+      }
+    }
+  }
+}
+
+void UArrangementTransformer::TransformCanvas::FillRect(
+  int x, int y, int width, int height,
+  uint8_t red, uint8_t green, uint8_t blue) {
+  for (int row = 0; row < height; ++row) {
+    int span_x = x, span_width = width, skip, out_x, out_y;
+    bool reversed;
+    if (!MapSpan(&span_x, y + row, &span_width, &skip,
+                 &out_x, &out_y, &reversed))
+      continue;
+    if (reversed) out_x -= span_width - 1;
+    delegatee_->FillRect(out_x, out_y, span_width, 1, red, green, blue);
+  }
+}
+
 UArrangementTransformer::UArrangementTransformer(int parallel)
   : canvas_(new TransformCanvas(parallel)) {
   assert(parallel > 0);
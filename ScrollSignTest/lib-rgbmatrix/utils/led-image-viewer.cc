@@ -92,17 +92,21 @@ static void StoreInStream(const Magick::Image &img, int delay_time_us,
   scratch->Clear();
   const int x_offset = do_center ? (scratch->width() - img.columns()) / 2 : 0;
   const int y_offset = do_center ? (scratch->height() - img.rows()) / 2 : 0;
+  // Transparent pixels stay black, just like the cleared canvas.
+  std::vector<uint8_t> rgb(img.columns() * img.rows() * 3, 0);
+  uint8_t *pixel = &rgb[0];
   for (size_t y = 0; y < img.rows(); ++y) {
-    for (size_t x = 0; x < img.columns(); ++x) {
+    for (size_t x = 0; x < img.columns(); ++x, pixel += 3) {
       const Magick::Color &c = img.pixelColor(x, y);
       if (c.alphaQuantum() < 256) {
-        scratch->SetPixel(x + x_offset, y + y_offset,
-                          ScaleQuantumToChar(c.redQuantum()),
-                          ScaleQuantumToChar(c.greenQuantum()),
-                          ScaleQuantumToChar(c.blueQuantum()));
+        pixel[0] = ScaleQuantumToChar(c.redQuantum());
+        pixel[1] = ScaleQuantumToChar(c.greenQuantum());
+        pixel[2] = ScaleQuantumToChar(c.blueQuantum());
       }
     }
   }
+  scratch->SetPixels(x_offset, y_offset, img.columns(), img.rows(),
+                     &rgb[0], img.columns() * 3);
   output->Stream(*scratch, delay_time_us);
 }
 
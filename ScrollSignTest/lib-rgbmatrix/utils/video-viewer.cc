@@ -43,19 +43,9 @@ static void InterruptHandler(int) {
 #  define av_frame_free avcodec_free_frame
 #endif
 
-struct LedPixel {
-  uint8_t r, g, b;
-};
 void CopyFrame(AVFrame *pFrame, FrameCanvas *canvas) {
   // Write pixel data
-  const int height = canvas->height();
-  const int width = canvas->width();
-  for(int y = 0; y < height; ++y) {
-    LedPixel *pix = (LedPixel*) (pFrame->data[0] + y*pFrame->linesize[0]);
-    for(int x = 0; x < width; ++x, ++pix) {
-      canvas->SetPixel(x, y, pix->r, pix->g, pix->b);
-    }
-  }
+  canvas->LoadRGB(pFrame->data[0], pFrame->linesize[0]);
 }
 
 static int usage(const char *progname) {